@@ -0,0 +1,46 @@
+#include <memory_resource>
+#include <type_traits>
+
+/**
+ * allocator that takes its memory from a std::pmr::memory_resource, usually the
+ * monotonic arena of one connection. Unlike std::pmr::polymorphic_allocator it is
+ * assignable, which Beast requires of the allocators of fields and buffers.
+ * Copies keep the same resource, so a copied request stays in the arena.
+*/
+template<class T>
+class ArenaAllocator{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    std::pmr::memory_resource * resource;
+
+    ArenaAllocator(std::pmr::memory_resource * r = std::pmr::get_default_resource()) noexcept : resource(r){}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U> & other) noexcept : resource(other.resource){}
+
+    T * allocate(std::size_t n){
+        return static_cast<T *>(resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T * p, std::size_t n) noexcept{
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U> & other) const noexcept{
+        return resource == other.resource;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U> & other) const noexcept{
+        return resource != other.resource;
+    }
+};
+
+//request parsing allocates from the arena of the connection, see Proxy::requestProcess
+typedef ArenaAllocator<char> arena_alloc;
+typedef http::request<http::basic_dynamic_body<beast::basic_multi_buffer<arena_alloc> >, http::basic_fields<arena_alloc> > arena_request;
+typedef beast::basic_flat_buffer<arena_alloc> arena_buffer;
@@ -1,49 +1,318 @@
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <cstdlib>
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <zlib.h>
 #include "parser.hpp"
 
+#define COMPRESS_MIN 1024       //bodies smaller than this are never compressed
+#define COMPRESS_PER_PUT 2      //cold bodies compressed at most by one put
+#define COMPRESS_MIN_AGE 100    //ticks a body stays unused before it can be compressed, whatever the size of the cache
+#define STATS_EVERY 100         //puts between two stats lines in the log
+
 class Cache{
 private:
+	/**
+	 * a body stored once for every key whose response has exactly these bytes
+	 * @param raw the bytes, NULL while compressed
+	 * @param packed zlib data of the bytes while compressed
+	 * @param size length of the bytes
+	 * @param serial number of the body, unlike its id never given to other bytes
+	 * @param refs number of keys using the body
+	 * @param used value of ticks when a key last stored or read the body
+	 * @param incompressible compression was tried and did not pay off
+	 * @param compressing a put is compressing the body outside the lock
+	*/
+	struct Body{
+		std::shared_ptr<const std::string> raw;
+		std::shared_ptr<const std::string> packed;
+		size_t size;
+		unsigned long serial;
+		int refs;
+		unsigned long used;
+		bool incompressible;
+		bool compressing;
+	};
+
+	/**
+	 * a stored body that may hold the bytes of a new one, taken under the lock and compared without it
+	 * @param id, serial which body it is
+	 * @param raw, packed the bytes of the body when it was taken, one of them is set
+	*/
+	struct Candidate{
+		size_t id;
+		unsigned long serial;
+		std::shared_ptr<const std::string> raw;
+		std::shared_ptr<const std::string> packed;
+	};
+
+	/**
+	 * a cached response: the header is kept per key, the body is shared
+	 * @param header status line and fields, Content-Length set to the body size;
+	 *        replaced, never changed in place, so a reader holding it is not disturbed
+	 * @param body id of the body in body_store
+	*/
+	struct Entry{
+		std::shared_ptr<const http::response<http::empty_body> > header;
+		size_t body;
+	};
+
 /**
  * @param cache_map key is hostname+target from requests
+ * @param body_store bodies by content hash, a colliding body takes the next free id
  * @param capacity number of items that can be stored
  * @param used_list least recently used item -> most recently used item
+ * @param compress whether cold bodies are compressed
  * @param rwlock read/write lock
+ * @param negative_map short-lived 5xx responses, key -> (expire time, response)
+ * @param unreachable_map "host:port" that recently failed to connect -> expire time
+ * @param logical_bytes sum of the body sizes of all keys, what the cache holds without sharing and compression
+ * @param ticks number of gets and puts so far, the age of a body is counted in ticks
+ * @param serials number of bodies stored so far
+ * @param puts, hits, hit_ns, decompressions counters for the stats
 */
-    std::map<std::string, http::response<http::dynamic_body> > cache_map;
+    std::map<std::string, Entry, std::less<> > cache_map;
+	std::unordered_map<size_t, Body> body_store;
 	int capacity;
 	std::vector<std::string> used_list; 
+	bool compress;
+	std::map<std::string, std::pair<time_t, http::response<http::dynamic_body> >, std::less<> > negative_map;
+	std::map<std::string, time_t> unreachable_map;
 	pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 	pthread_mutex_t * loglock;
 	std::ofstream * LogStream;
+	size_t logical_bytes = 0;
+	unsigned long ticks = 0;
+	unsigned long serials = 0;
+	unsigned long puts = 0;
+	unsigned long hits = 0;
+	unsigned long hit_ns = 0;
+	unsigned long decompressions = 0;
 
 	/**
-	 * this method remove the least used item from the object
+	 * this method remove the least used item from the object, caller must hold the write lock
+	 * @return the evicted key
 	*/
-	void evict(){
-		pthread_rwlock_wrlock(&rwlock);
+	std::string evict(){
 		std::string key = used_list[0];
-		cache_map.erase(key);
+		auto it = cache_map.find(key);
+		logical_bytes -= body_store[it->second.body].size;
+		releaseBody(it->second.body);
+		cache_map.erase(it);
 		used_list.erase(used_list.begin());
 		capacity++;
+		return key;
+	}
+
+	/**
+	 * look for a stored body with exactly these bytes, the bytes are compared without holding the lock;
+	 * a compressed body is decompressed into a copy, so it stays compressed and is not counted as a decompression
+	 * caller must not hold the lock
+	 * @param data the bytes of the body
+	 * @param hash content hash of the bytes, where their ids start
+	 * @param id placeholder for the id of the body found
+	 * @return serial of the body found; 0 if none holds these bytes
+	*/
+	unsigned long findBody(const std::string & data, size_t hash, size_t * id){
+		std::vector<Candidate> candidates;
+		pthread_rwlock_rdlock(&rwlock);
+		for(size_t next = hash; ; next++){
+			auto it = body_store.find(next);
+			if(it == body_store.end()){
+				break;
+			}
+			if(it->second.size == data.size()){
+				candidates.push_back(Candidate{next, it->second.serial, it->second.raw, it->second.packed});
+			}
+		}
 		pthread_rwlock_unlock(&rwlock);
-		pthread_mutex_lock(loglock);
-		*LogStream<<"(no-id): NOTE evicted \""<< key<<"\" from cache" <<std::endl;
-		pthread_mutex_unlock(loglock);
+		for(size_t i = 0; i < candidates.size(); i++){
+			bool same;
+			if(candidates[i].raw){
+				same = *candidates[i].raw == data;
+			}else{
+				std::string bytes;
+				same = unpack(*candidates[i].packed, data.size(), &bytes) && bytes == data;
+			}
+			if(same){
+				*id = candidates[i].id;
+				return candidates[i].serial;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * take one more reference on the body found by findBody if it is still stored,
+	 * store the bytes as a new body otherwise
+	 * caller must hold the write lock
+	 * @param data the bytes of the body
+	 * @param hash content hash of the bytes
+	 * @param id, serial the body found by findBody, serial 0 if none
+	 * @return id of the body
+	*/
+	size_t storeBody(std::string & data, size_t hash, size_t id, unsigned long serial){
+		if(serial != 0){
+			auto it = body_store.find(id);
+			if(it != body_store.end() && it->second.serial == serial){
+				it->second.refs++;
+				it->second.used = ticks;
+				return id;
+			}
+		}
+		//a colliding body takes the next free id
+		id = hash;
+		while(body_store.find(id) != body_store.end()){
+			id++;
+		}
+		Body & body = body_store[id];
+		body.size = data.size();
+		body.raw = std::make_shared<const std::string>(std::move(data));
+		body.serial = ++serials;
+		body.refs = 1;
+		body.used = ticks;
+		body.incompressible = false;
+		body.compressing = false;
+		return id;
+	}
+
+	/**
+	 * decompress zlib data
+	 * @param size length of the bytes before compression
+	 * @param data placeholder for the bytes
+	 * @return false if the data is corrupt
+	*/
+	static bool unpack(const std::string & packed, size_t size, std::string * data){
+		data->assign(size, '\0');
+		uLongf length = size;
+		return uncompress((Bytef *)&(*data)[0], &length, (const Bytef *)packed.data(), packed.size()) == Z_OK && length == size;
+	}
+
+	/**
+	 * drop one reference on a body, the body is freed with its last reference
+	 * caller must hold the write lock
+	*/
+	void releaseBody(size_t id){
+		auto it = body_store.find(id);
+		if(--it->second.refs == 0){
+			body_store.erase(it);
+		}
+	}
+
+	/**
+	 * the bytes of a body, a compressed body is decompressed and kept that way
+	 * caller must hold the write lock
+	*/
+	std::shared_ptr<const std::string> openBody(Body & body){
+		if(!body.raw){
+			std::string data;
+			if(!unpack(*body.packed, body.size, &data)){
+				throw std::runtime_error("corrupt compressed body");
+			}
+			body.raw = std::make_shared<const std::string>(std::move(data));
+			body.packed.reset();
+			decompressions++;
+		}
+		return body.raw;
+	}
+
+	/**
+	 * pick a few bodies of the least recently used half of the cache to compress
+	 * a body shared with a key used since, or stored or read in the last COMPRESS_MIN_AGE ticks, is not cold and left alone
+	 * caller must hold the write lock
+	 * @param cold placeholder for the picked bodies: id and the bytes to compress
+	*/
+	void pickCold(std::vector<std::pair<size_t, std::shared_ptr<const std::string> > > * cold){
+		unsigned long half = used_list.size() / 2;
+		unsigned long age = std::max(half, (unsigned long)COMPRESS_MIN_AGE);
+		for(size_t i = 0; i < half && cold->size() < COMPRESS_PER_PUT; i++){
+			size_t id = cache_map.find(used_list[i])->second.body;
+			Body & body = body_store[id];
+			if(!body.raw || body.incompressible || body.compressing || body.size < COMPRESS_MIN || ticks - body.used < age){
+				continue;
+			}
+			body.compressing = true;
+			cold->push_back(std::make_pair(id, body.raw));
+		}
+	}
+
+	/**
+	 * compress the picked bodies without holding the lock, then put each in place of its bytes
+	 * unless the body was freed or decompressed meanwhile
+	 * a body is kept compressed only if that saves at least an eighth of it
+	*/
+	void compressCold(std::vector<std::pair<size_t, std::shared_ptr<const std::string> > > & cold){
+		for(size_t i = 0; i < cold.size(); i++){
+			const std::string & data = *cold[i].second;
+			std::string packed(compressBound(data.size()), '\0');
+			uLongf length = packed.size();
+			bool pays = compress2((Bytef *)&packed[0], &length, (const Bytef *)data.data(), data.size(), Z_BEST_SPEED) == Z_OK
+				&& length <= data.size() - data.size() / 8;
+			if(pays){
+				packed.resize(length);
+				packed.shrink_to_fit();
+			}
+			pthread_rwlock_wrlock(&rwlock);
+			auto it = body_store.find(cold[i].first);
+			//the same bytes still stored under the id, a freed id may have been taken by other bytes
+			if(it != body_store.end() && it->second.raw == cold[i].second){
+				it->second.compressing = false;
+				if(pays){
+					it->second.packed = std::make_shared<const std::string>(std::move(packed));
+					it->second.raw.reset();
+				}else{
+					it->second.incompressible = true;
+				}
+			}
+			pthread_rwlock_unlock(&rwlock);
+		}
+	}
+
+	/**
+	 * split a response into the header kept per key and its body bytes
+	 * the header gets a Content-Length, the body is sent as is when served
+	*/
+	static void splitResponse(http::response<http::dynamic_body> & response, http::response<http::empty_body> * header, std::string * data){
+		*data = beast::buffers_to_string(response.body().data());
+		*header = http::response<http::empty_body>(response.base());
+		unsigned status = header->result_int();
+		if(status / 100 != 1 && status != 204 && status != 304){
+			header->content_length(data->size());
+		}
+	}
+
+	/**
+	 * drop expired negative entries, caller must hold the write lock
+	*/
+	void pruneNegative(time_t now){
+		for(auto it = negative_map.begin(); it != negative_map.end();){
+			if(it->second.first <= now){
+				it = negative_map.erase(it);
+			}else{
+				++it;
+			}
+		}
+		for(auto it = unreachable_map.begin(); it != unreachable_map.end();){
+			if(it->second <= now){
+				it = unreachable_map.erase(it);
+			}else{
+				++it;
+			}
+		}
 	}
 
 public:
-    Cache(int m, pthread_mutex_t * ll, std::ofstream * s):capacity(m), loglock(ll), LogStream(s){}
+    Cache(int m, bool z, pthread_mutex_t * ll, std::ofstream * s):capacity(m), compress(z), loglock(ll), LogStream(s){}
 
 	/**
 	 * whether the key in in the cache
 	 * @param key the key of the map
 	 * @return true if in cache; false if not
 	*/
-	bool isInCache(std::string & key){
+	bool isInCache(std::string_view key){
 		pthread_rwlock_rdlock(&rwlock);
 		bool result = cache_map.find(key) != cache_map.end();
 		pthread_rwlock_unlock(&rwlock);
@@ -56,60 +325,236 @@ public:
 	 * @param key key in the map
 	 * @param response response to store in the cache
 	*/
-	int update(std::string & key, http::response<http::dynamic_body> response){
-		if(isInCache(key)){
-			pthread_rwlock_wrlock(&rwlock);
-			cache_map[key] = response;
+	int update(std::string_view key, http::response<http::dynamic_body> & response){
+		http::response<http::empty_body> header;
+		std::string data;
+		splitResponse(response, &header, &data);
+		size_t size = data.size();
+		size_t hash = std::hash<std::string_view>()(data);
+		size_t id;
+		unsigned long serial = findBody(data, hash, &id);
+		pthread_rwlock_wrlock(&rwlock);
+		auto it = cache_map.find(key);
+		if(it == cache_map.end()){
 			pthread_rwlock_unlock(&rwlock);
-			return 1;
-		} 
-		return 0;
+			return 0;
+		}
+		//store before releasing, the old body may be the one found
+		size_t old = it->second.body;
+		logical_bytes -= body_store[old].size;
+		it->second.header = std::make_shared<const http::response<http::empty_body> >(std::move(header));
+		it->second.body = storeBody(data, hash, id, serial);
+		releaseBody(old);
+		logical_bytes += size;
+		pthread_rwlock_unlock(&rwlock);
+		return 1;
 	}
 	/**
-	 * return the reponse stored in cache, update the LRU list
-	 * @param key the key to get
-	 * @return NULL if not in cache; reponse stored in cache
+	 * update the header of one key from a 304 answering its validation (RFC 9111 section 4.3.4):
+	 * every field the 304 carries replaces the stored one, except Content-Length
+	 * @param key key in the map
+	 * @param not_modified the 304 response from the server
+	 * @return the updated header; NULL if the key is no longer in the cache
 	*/
-	http::response<http::dynamic_body> * get(std::string & key){
-		if(!isInCache(key)){
+	std::shared_ptr<const http::response<http::empty_body> > refresh(std::string_view key, const http::response_header<> & not_modified){
+		pthread_rwlock_wrlock(&rwlock);
+		auto it = cache_map.find(key);
+		if(it == cache_map.end()){
+			pthread_rwlock_unlock(&rwlock);
 			return NULL;
 		}
+		http::response<http::empty_body> header = *it->second.header;
+		for(auto & field : not_modified){
+			if(field.name() != http::field::content_length){
+				header.erase(field.name_string());
+			}
+		}
+		for(auto & field : not_modified){
+			if(field.name() != http::field::content_length){
+				header.insert(field.name_string(), field.value());
+			}
+		}
+		it->second.header = std::make_shared<const http::response<http::empty_body> >(std::move(header));
+		std::shared_ptr<const http::response<http::empty_body> > result = it->second.header;
+		pthread_rwlock_unlock(&rwlock);
+		return result;
+	}
+
+	/**
+	 * return the reponse stored in cache, update the LRU list
+	 * header and body stay valid after an eviction or an update of the key
+	 * @param key the key to get
+	 * @param body placeholder for the body of the response
+	 * @return NULL if not in cache; header of the reponse stored in cache
+	*/
+	std::shared_ptr<const http::response<http::empty_body> > get(std::string_view key, std::shared_ptr<const std::string> * body){
 		//update the used_list
 		pthread_rwlock_wrlock(&rwlock);
-		for(int i = 0; i < used_list.size(); i++){
+		//time the lookup and decompression, not the wait for the lock
+		auto start = std::chrono::steady_clock::now();
+		auto it = cache_map.find(key);
+		if(it == cache_map.end()){
+			pthread_rwlock_unlock(&rwlock);
+			return NULL;
+		}
+		for(size_t i = 0; i < used_list.size(); i++){
 			if(used_list[i].compare(key) == 0){
-				//update used_list if not alreadly the newest
+				//update used_list if not alreadly the newest, reuse the stored key string
 				if(i!=used_list.size()-1){
+					std::string used = std::move(used_list[i]);
 					used_list.erase(used_list.begin()+ i);
-					used_list.push_back(key);
+					used_list.push_back(std::move(used));
 				}
+				break;
 			}
 		}
+		Body & stored = body_store[it->second.body];
+		try{
+			*body = openBody(stored);
+		}catch(std::runtime_error & e){
+			pthread_rwlock_unlock(&rwlock);
+			throw;
+		}
+		stored.used = ++ticks;
+		hits++;
+		hit_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		std::shared_ptr<const http::response<http::empty_body> > header = it->second.header;
 		pthread_rwlock_unlock(&rwlock);
-		return &cache_map[key];
+		return header;
 	}
 	
 	/**
-	 * insert a item into the cache
+	 * insert a item into the cache, evict the least recently used one if full
 	 * @param key 
 	 * @param reponse value
 	 * @return 1 if success, 0 if not
 	*/
-	int put(std::string key, http::response<http::dynamic_body> response){
+	int put(std::string_view key, http::response<http::dynamic_body> & response){
+		http::response<http::empty_body> header;
+		std::string data;
+		splitResponse(response, &header, &data);
+		size_t size = data.size();
+		std::string evicted;
+		std::vector<std::pair<size_t, std::shared_ptr<const std::string> > > cold;
+		size_t hash = std::hash<std::string_view>()(data);
+		size_t id;
+		unsigned long serial = findBody(data, hash, &id);
+		pthread_rwlock_wrlock(&rwlock);
 		//already in cache, do not store
-		if(isInCache(key)){
+		if(cache_map.find(key) != cache_map.end()){
+			pthread_rwlock_unlock(&rwlock);
 			return 0;
 		}
 		if(capacity == 0){
-			evict();
-		}else{
-			pthread_rwlock_wrlock(&rwlock);
-			cache_map[key] = response;
-			capacity--;
-			used_list.push_back(key);
-			pthread_rwlock_unlock(&rwlock);
-			return 1;
+			evicted = evict();
+		}
+		Entry & entry = cache_map[std::string(key)];
+		entry.header = std::make_shared<const http::response<http::empty_body> >(std::move(header));
+		entry.body = storeBody(data, hash, id, serial);
+		logical_bytes += size;
+		capacity--;
+		ticks++;
+		used_list.push_back(std::string(key));
+		if(compress){
+			pickCold(&cold);
+		}
+		bool stats = ++puts % STATS_EVERY == 0;
+		pthread_rwlock_unlock(&rwlock);
+		compressCold(cold);
+		if(!evicted.empty()){
+			pthread_mutex_lock(loglock);
+			*LogStream<<"(no-id): NOTE evicted \""<< evicted<<"\" from cache" <<std::endl;
+			pthread_mutex_unlock(loglock);
+		}
+		if(stats){
+			logStats();
 		}
-		return 0; 
+		return 1;
+	}
+
+	/**
+	 * write the stats to the log: space saved by sharing and compressing bodies,
+	 * and the time a hit spends finding its key and body, decompression included
+	*/
+	void logStats(){
+		pthread_rwlock_rdlock(&rwlock);
+		size_t stored_bytes = 0;
+		size_t packed = 0;
+		for(auto it = body_store.begin(); it != body_store.end(); ++it){
+			if(it->second.raw){
+				stored_bytes += it->second.size;
+			}else{
+				stored_bytes += it->second.packed->size();
+				packed++;
+			}
+		}
+		size_t entries = cache_map.size();
+		size_t bodies = body_store.size();
+		size_t logical = logical_bytes;
+		unsigned long h = hits;
+		double us_per_hit = hits == 0 ? 0 : hit_ns / 1000.0 / hits;
+		unsigned long d = decompressions;
+		pthread_rwlock_unlock(&rwlock);
+		pthread_mutex_lock(loglock);
+		*LogStream<<"(no-id): NOTE cache stats: "<<entries<<" entries, "<<bodies<<" bodies ("<<packed<<" compressed), "
+			<<logical<<" bytes stored in "<<stored_bytes<<" bytes (capacity x"<<(stored_bytes == 0 ? 1.0 : (double)logical / stored_bytes)
+			<<"), "<<h<<" hits, "<<us_per_hit<<" us per hit, "<<d<<" decompressions"<<std::endl;
+		pthread_mutex_unlock(loglock);
+	}
+
+	/**
+	 * store an origin error response for a short time, outside the LRU list
+	 * @param key key in the map
+	 * @param response the 5xx response from the server
+	 * @param expire time after which the entry is ignored
+	*/
+	void putNegative(std::string_view key, http::response<http::dynamic_body> response, time_t expire){
+		pthread_rwlock_wrlock(&rwlock);
+		pruneNegative(gmtNow());
+		negative_map[std::string(key)] = std::make_pair(expire, response);
+		pthread_rwlock_unlock(&rwlock);
+	}
+
+	/**
+	 * look up a negative entry that has not expired yet
+	 * @param key the key to get
+	 * @param response placeholder for a copy of the stored response
+	 * @return true if found and still valid; false if not
+	*/
+	bool getNegative(std::string_view key, http::response<http::dynamic_body> * response){
+		bool result = false;
+		pthread_rwlock_rdlock(&rwlock);
+		auto it = negative_map.find(key);
+		if(it != negative_map.end() && it->second.first > gmtNow()){
+			*response = it->second.second;
+			result = true;
+		}
+		pthread_rwlock_unlock(&rwlock);
+		return result;
+	}
+
+	/**
+	 * remember that a server could not be reached
+	 * @param server "host:port" of the server
+	 * @param expire time until which connection attempts are skipped
+	*/
+	void markUnreachable(std::string server, time_t expire){
+		pthread_rwlock_wrlock(&rwlock);
+		pruneNegative(gmtNow());
+		unreachable_map[server] = expire;
+		pthread_rwlock_unlock(&rwlock);
+	}
+
+	/**
+	 * whether a server recently failed to connect
+	 * @param server "host:port" of the server
+	 * @return true if connection should not be tried; false if not
+	*/
+	bool isUnreachable(std::string & server){
+		pthread_rwlock_rdlock(&rwlock);
+		auto it = unreachable_map.find(server);
+		bool result = it != unreachable_map.end() && it->second > gmtNow();
+		pthread_rwlock_unlock(&rwlock);
+		return result;
 	}
 }; 
\ No newline at end of file
@@ -0,0 +1,349 @@
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <poll.h>
+#include <unistd.h>
+
+#define PEER_HEADER "X-Proxy-Peer"  //marks a request sent by a peer proxy, value is the sender
+#define VIRTUAL_NODES 100           //points of each member on the hash ring
+#define HEALTH_INTERVAL 2           //seconds between two health checks of a peer
+#define PEER_TIMEOUT 15             //seconds a peer has to send its whole response
+
+class Cluster{
+private:
+/**
+ * @param self name of this proxy as the peers know it, "host:port"
+ * @param peers names of the other proxies of the cluster
+ * @param alive health of every peer, only alive peers are on the ring
+ * @param ring hash -> member, VIRTUAL_NODES points per member
+ * @param channels idle keep-alive connections to every peer
+ * @param addresses addresses of the peers, the only ones whose PEER_HEADER is trusted
+ * @param rwlock read/write lock of alive, ring and addresses
+ * @param channel_lock lock of channels
+*/
+	std::string self;
+	std::vector<std::string> peers;
+	std::map<std::string, bool> alive;
+	std::map<uint64_t, std::string> ring;
+	std::map<std::string, std::vector<tcp::socket *> > channels;
+	std::set<net::ip::address> addresses;
+	pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+	pthread_mutex_t channel_lock = PTHREAD_MUTEX_INITIALIZER;
+	net::io_context & io_context;
+	pthread_mutex_t * loglock;
+	std::ofstream * LogStream;
+
+	/**
+	 * place self and every alive peer on the ring, caller must hold the write lock
+	*/
+	void rebuild(){
+		ring.clear();
+		for(int i = 0; i < VIRTUAL_NODES; i++){
+			ring[hash(self + "#" + std::to_string(i))] = self;
+		}
+		for(size_t p = 0; p < peers.size(); p++){
+			if(!alive[peers[p]]){
+				continue;
+			}
+			for(int i = 0; i < VIRTUAL_NODES; i++){
+				ring[hash(peers[p] + "#" + std::to_string(i))] = peers[p];
+			}
+		}
+	}
+
+	/**
+	 * resolve the names of the peers again, a peer may change its address when it restarts
+	*/
+	void resolvePeers(){
+		std::set<net::ip::address> found;
+		tcp::resolver resolver(io_context);
+		for(size_t p = 0; p < peers.size(); p++){
+			size_t f = peers[p].rfind(':');
+			boost::system::error_code ec;
+			tcp::resolver::results_type results = resolver.resolve(peers[p].substr(0, f), peers[p].substr(f+1), ec);
+			for(auto it = results.begin(); it != results.end() && !ec; ++it){
+				net::ip::address address = it->endpoint().address();
+				found.insert(address);
+				if(address.is_v6() && address.to_v6().is_v4_mapped()){
+					found.insert(net::ip::make_address_v4(net::ip::v4_mapped, address.to_v6()));
+				}
+			}
+		}
+		pthread_rwlock_wrlock(&rwlock);
+		addresses.swap(found);
+		pthread_rwlock_unlock(&rwlock);
+	}
+
+	/**
+	 * get a connection to a peer, an idle one if there is one
+	 * @param peer name of the peer
+	 * @param reused placeholder, set to true if the connection was idle in the pool
+	 * @return the connection; NULL if the peer cannot be reached
+	*/
+	tcp::socket * takeChannel(const std::string & peer, bool * reused){
+		pthread_mutex_lock(&channel_lock);
+		std::vector<tcp::socket *> & idle = channels[peer];
+		if(!idle.empty()){
+			tcp::socket * channel = idle.back();
+			idle.pop_back();
+			pthread_mutex_unlock(&channel_lock);
+			*reused = true;
+			return channel;
+		}
+		pthread_mutex_unlock(&channel_lock);
+		*reused = false;
+		size_t f = peer.rfind(':');
+		tcp::socket * channel = new tcp::socket(io_context);
+		try{
+			tcp::resolver resolver(io_context);
+			net::connect(*channel, resolver.resolve(peer.substr(0, f), peer.substr(f+1)));
+		}catch(std::exception & e){
+			delete channel;
+			return NULL;
+		}
+		return channel;
+	}
+
+	/**
+	 * put a connection back into the pool after a complete exchange
+	*/
+	void giveBack(const std::string & peer, tcp::socket * channel){
+		pthread_mutex_lock(&channel_lock);
+		channels[peer].push_back(channel);
+		pthread_mutex_unlock(&channel_lock);
+	}
+
+	/**
+	 * reads from a peer connection until a deadline. The blocking reads of Asio cannot time out,
+	 * so every read first waits in poll() for the time that is left
+	*/
+	class DeadlineReader{
+	public:
+		tcp::socket * socket;
+		std::chrono::steady_clock::time_point deadline;
+
+		DeadlineReader(tcp::socket * s, int seconds):socket(s), deadline(std::chrono::steady_clock::now() + std::chrono::seconds(seconds)){}
+
+		template<class MutableBufferSequence>
+		size_t read_some(const MutableBufferSequence & buffers){
+			boost::system::error_code ec;
+			size_t n = read_some(buffers, ec);
+			if(ec){
+				throw boost::system::system_error(ec);
+			}
+			return n;
+		}
+
+		template<class MutableBufferSequence>
+		size_t read_some(const MutableBufferSequence & buffers, boost::system::error_code & ec){
+			while(socket->available(ec) == 0 && !ec){
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+				if(left <= 0){
+					ec = net::error::timed_out;
+					return 0;
+				}
+				struct pollfd fd = {socket->native_handle(), POLLIN, 0};
+				int ready = poll(&fd, 1, left);
+				if(ready < 0 && errno != EINTR){
+					ec.assign(errno, boost::system::system_category());
+					return 0;
+				}
+				if(ready > 0){
+					//data, or the end of the connection
+					break;
+				}
+			}
+			if(ec){
+				return 0;
+			}
+			return socket->read_some(buffers, ec);
+		}
+	};
+
+	/**
+	 * close every idle connection to a peer
+	*/
+	void dropChannels(const std::string & peer){
+		pthread_mutex_lock(&channel_lock);
+		std::vector<tcp::socket *> idle;
+		idle.swap(channels[peer]);
+		pthread_mutex_unlock(&channel_lock);
+		for(size_t i = 0; i < idle.size(); i++){
+			boost::system::error_code ec;
+			idle[i]->close(ec);
+			delete idle[i];
+		}
+	}
+
+public:
+	Cluster(net::io_context & io, std::string s, std::vector<std::string> p, pthread_mutex_t * ll, std::ofstream * log):
+		self(s), peers(p), io_context(io), loglock(ll), LogStream(log){
+		//peers start alive, the first health check removes the ones that are not
+		for(size_t i = 0; i < peers.size(); i++){
+			alive[peers[i]] = true;
+		}
+		rebuild();
+		resolvePeers();
+	}
+
+	/**
+	 * whether this proxy runs with peers
+	*/
+	bool enabled(){
+		return !peers.empty();
+	}
+
+	/**
+	 * whether a connection comes from a peer, only then is its PEER_HEADER trusted
+	 * @param address remote address of the connection
+	*/
+	bool isPeer(const net::ip::address & address){
+		pthread_rwlock_rdlock(&rwlock);
+		bool found = addresses.count(address) != 0;
+		pthread_rwlock_unlock(&rwlock);
+		return found;
+	}
+
+	/**
+	 * name of this proxy in the cluster
+	*/
+	const std::string & name(){
+		return self;
+	}
+
+	/**
+	 * 64-bit FNV-1a, used to place members and keys on the ring
+	 * FNV leaves strings that differ only at the end close together in the high bits,
+	 * the murmur3 finalizer spreads them over the whole ring
+	*/
+	static uint64_t hash(std::string_view str){
+		uint64_t h = 14695981039346656037ULL;
+		for(size_t i = 0; i < str.size(); i++){
+			h ^= (unsigned char)str[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	/**
+	 * find the member responsible for a cache key: the first point on the ring at or after its hash
+	 * @param key the cache key
+	 * @return name of the member, self if the key belongs to this proxy
+	*/
+	std::string owner(std::string_view key){
+		pthread_rwlock_rdlock(&rwlock);
+		auto it = ring.lower_bound(hash(key));
+		if(it == ring.end()){
+			it = ring.begin();
+		}
+		std::string result = it->second;
+		pthread_rwlock_unlock(&rwlock);
+		return result;
+	}
+
+	/**
+	 * record the health of a peer, the ring is rebuilt when it changes
+	 * @param peer name of the peer
+	 * @param up true if the peer answered
+	*/
+	void markPeer(const std::string & peer, bool up){
+		pthread_rwlock_wrlock(&rwlock);
+		bool changed = alive[peer] != up;
+		if(changed){
+			alive[peer] = up;
+			rebuild();
+		}
+		size_t points = ring.size();
+		pthread_rwlock_unlock(&rwlock);
+		if(!changed){
+			return;
+		}
+		if(!up){
+			dropChannels(peer);
+		}
+		pthread_mutex_lock(loglock);
+		*LogStream<<"(no-id): NOTE peer "<<peer<<(up ? " up" : " down")<<", ring has "<<points<<" points"<<std::endl;
+		pthread_mutex_unlock(loglock);
+	}
+
+	/**
+	 * send one request to a peer over a keep-alive connection and read its response
+	 * an idle connection may have been closed by the peer meanwhile, then a new one is tried.
+	 * A peer that does not answer within PEER_TIMEOUT seconds is given up on
+	 * @param peer name of the peer
+	 * @param request request to send, must carry PEER_HEADER
+	 * @param buffer buffer for reading the response
+	 * @param response placeholder for the response
+	 * @param timed_out placeholder, set when the peer was reached but did not answer in time; may be NULL
+	 * @return true if a response was read; false if the peer cannot be reached or timed out
+	*/
+	template<class Request, class Buffer>
+	bool fetch(const std::string & peer, Request & request, Buffer & buffer, http::response<http::dynamic_body> * response, bool * timed_out){
+		if(timed_out != NULL){
+			*timed_out = false;
+		}
+		for(int attempt = 0; attempt < 2; attempt++){
+			bool reused;
+			tcp::socket * channel = takeChannel(peer, &reused);
+			if(channel == NULL){
+				return false;
+			}
+			boost::system::error_code ec;
+			http::write(*channel, request, ec);
+			if(ec.value() == 0){
+				DeadlineReader reader(channel, PEER_TIMEOUT);
+				http::read(reader, buffer, *response, ec);
+			}
+			if(ec.value() == 0){
+				if(response->need_eof()){
+					channel->close(ec);
+					delete channel;
+				}else{
+					giveBack(peer, channel);
+				}
+				return true;
+			}
+			bool slow = ec == net::error::timed_out;
+			channel->close(ec);
+			delete channel;
+			//a peer that is too slow is not asked a second time
+			if(slow && timed_out != NULL){
+				*timed_out = true;
+			}
+			if(!reused || slow){
+				return false;
+			}
+			buffer.consume(buffer.size());
+			*response = http::response<http::dynamic_body>();
+		}
+		return false;
+	}
+
+	/**
+	 * check every peer each HEALTH_INTERVAL seconds with "OPTIONS *", never returns
+	*/
+	void healthLoop(){
+		while(true){
+			resolvePeers();
+			for(size_t i = 0; i < peers.size(); i++){
+				http::request<http::empty_body> ping{http::verb::options, "*", 11};
+				ping.set(http::field::host, peers[i]);
+				ping.set(PEER_HEADER, self);
+				ping.keep_alive(true);
+				beast::flat_buffer buffer;
+				http::response<http::dynamic_body> pong;
+				bool up = fetch(peers[i], ping, buffer, &pong, NULL) && pong.result_int() == 200;
+				markPeer(peers[i], up);
+			}
+			sleep(HEALTH_INTERVAL);
+		}
+	}
+};
@@ -0,0 +1,486 @@
+#include <nghttp2/nghttp2.h>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <functional>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define H2_MAX_STREAMS 100      //streams a client may have open at once on one connection
+#define H2_READ_CHUNK 16384     //bytes read from the client connection at once
+
+/**
+ * in-memory stream that takes the place of the client socket for one HTTP/2 stream:
+ * GET and POST write their HTTP/1.1 response into it, then it is read back as a
+ * response, which is sent on the stream as HEADERS and DATA frames
+*/
+class ResponseCapture{
+public:
+	beast::flat_buffer data;
+
+	template<class ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence & buffers){
+		boost::system::error_code ec;
+		return write_some(buffers, ec);
+	}
+
+	template<class ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence & buffers, boost::system::error_code & ec){
+		ec = {};
+		size_t n = net::buffer_copy(data.prepare(net::buffer_size(buffers)), buffers);
+		data.commit(n);
+		return n;
+	}
+
+	template<class MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence & buffers){
+		boost::system::error_code ec;
+		size_t n = read_some(buffers, ec);
+		if(ec){
+			throw boost::system::system_error(ec);
+		}
+		return n;
+	}
+
+	template<class MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence & buffers, boost::system::error_code & ec){
+		if(data.size() == 0){
+			ec = net::error::eof;
+			return 0;
+		}
+		ec = {};
+		size_t n = net::buffer_copy(buffers, data.data());
+		data.consume(n);
+		return n;
+	}
+};
+
+/**
+ * responses finished by the stream threads, waiting for the connection thread to send them.
+ * The threads may outlive the connection, so it is shared and dropped by whoever is last
+ * @param lock lock of ready and closed
+ * @param ready stream id -> response, in the order they were finished
+ * @param wake pipe written once per response so the connection thread leaves poll
+ * @param closed set when the connection is gone, later responses are thrown away
+*/
+struct Http2Outbox{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	std::deque<std::pair<int32_t, http::response<http::dynamic_body> *> > ready;
+	int wake[2];
+	bool closed = false;
+
+	Http2Outbox(){
+		//non-blocking: post() writes while holding the lock, a full pipe must not stall it
+		if(pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0){
+			throw std::runtime_error("cannot create HTTP/2 wake pipe");
+		}
+	}
+
+	~Http2Outbox(){
+		for(size_t i = 0; i < ready.size(); i++){
+			delete ready[i].second;
+		}
+		close(wake[0]);
+		close(wake[1]);
+	}
+
+	void post(int32_t stream, http::response<http::dynamic_body> * response){
+		pthread_mutex_lock(&lock);
+		if(closed){
+			pthread_mutex_unlock(&lock);
+			delete response;
+			return;
+		}
+		ready.push_back(std::make_pair(stream, response));
+		char token = 0;
+		if(write(wake[1], &token, 1) != 1){
+			//the pipe is full, the connection thread has wake-ups pending anyway
+		}
+		pthread_mutex_unlock(&lock);
+	}
+};
+
+/**
+ * one client connection speaking HTTP/2 over cleartext TCP (h2c), either with prior
+ * knowledge or after an HTTP/1.1 Upgrade. nghttp2 does the framing, HPACK, flow control
+ * and the priority order of the frames sent; this class only moves bytes between it and
+ * the socket. A complete request is handed to a thread of its own, so the streams are
+ * served in parallel and a slow one never holds up the others.
+*/
+class Http2Connection{
+public:
+	/**
+	 * serve the complete request of one stream, called on a thread of its own
+	 * @param request the request in HTTP/1.1 form with an absolute target
+	 * @param response placeholder for the response
+	*/
+	typedef std::function<void(arena_request * request, http::response<http::dynamic_body> * response)> Handler;
+
+private:
+	/**
+	 * a stream of the connection
+	 * @param request request while its frames arrive, handed over to a thread once complete
+	 * @param method, scheme, authority, path the pseudo-header fields of the request
+	 * @param body body of the response while its DATA frames are sent, from offset on
+	 * @param started the request was handed over, later frames of the stream are ignored
+	*/
+	struct Stream{
+		arena_request request;
+		std::string method;
+		std::string scheme;
+		std::string authority;
+		std::string path;
+		std::string body;
+		size_t offset = 0;
+		bool started = false;
+	};
+	ClientStream * client;
+	Handler handler;
+	nghttp2_session * session;
+	std::map<int32_t, Stream> streams;
+	std::shared_ptr<Http2Outbox> outbox;
+
+	static ssize_t onSend(nghttp2_session * session, const uint8_t * data, size_t length, int flags, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		boost::system::error_code ec;
+		net::write(*self->client, net::buffer(data, length), ec);
+		if(ec.value() != 0){
+			return NGHTTP2_ERR_CALLBACK_FAILURE;
+		}
+		return length;
+	}
+
+	static int onBeginHeaders(nghttp2_session * session, const nghttp2_frame * frame, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		if(frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST){
+			self->streams[frame->hd.stream_id];
+		}
+		return 0;
+	}
+
+	static int onHeader(nghttp2_session * session, const nghttp2_frame * frame, const uint8_t * name, size_t namelen,
+		const uint8_t * value, size_t valuelen, uint8_t flags, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		auto it = self->streams.find(frame->hd.stream_id);
+		if(it == self->streams.end()){
+			return 0;
+		}
+		Stream & stream = it->second;
+		beast::string_view n((const char *)name, namelen);
+		beast::string_view v((const char *)value, valuelen);
+		if(n == ":method"){
+			stream.method.assign(v.data(), v.size());
+		}else if(n == ":scheme"){
+			stream.scheme.assign(v.data(), v.size());
+		}else if(n == ":authority"){
+			stream.authority.assign(v.data(), v.size());
+		}else if(n == ":path"){
+			stream.path.assign(v.data(), v.size());
+		}else if(n == "cookie" && stream.request.find(http::field::cookie) != stream.request.end()){
+			//HTTP/2 may split the cookies over several fields, HTTP/1.1 wants them in one
+			std::string cookie(stream.request[http::field::cookie]);
+			cookie.append("; ").append(v.data(), v.size());
+			stream.request.set(http::field::cookie, cookie);
+		}else{
+			stream.request.insert(n, v);
+		}
+		return 0;
+	}
+
+	static int onDataChunk(nghttp2_session * session, uint8_t flags, int32_t stream_id, const uint8_t * data, size_t len, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		auto it = self->streams.find(stream_id);
+		if(it == self->streams.end()){
+			return 0;
+		}
+		auto & body = it->second.request.body();
+		body.commit(net::buffer_copy(body.prepare(len), net::buffer(data, len)));
+		return 0;
+	}
+
+	static int onFrameRecv(nghttp2_session * session, const nghttp2_frame * frame, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		if(frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA){
+			return 0;
+		}
+		auto it = self->streams.find(frame->hd.stream_id);
+		if(it == self->streams.end() || it->second.started){
+			return 0;
+		}
+		//a CONNECT stream never ends, it is refused as soon as its headers are in
+		bool connect = frame->hd.type == NGHTTP2_HEADERS && it->second.method == "CONNECT";
+		if((frame->hd.flags & NGHTTP2_FLAG_END_STREAM) || connect){
+			it->second.started = true;
+			self->start(frame->hd.stream_id, self->toRequest(&it->second));
+		}
+		return 0;
+	}
+
+	static int onStreamClose(nghttp2_session * session, int32_t stream_id, uint32_t error_code, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		self->streams.erase(stream_id);
+		return 0;
+	}
+
+	static ssize_t onRead(nghttp2_session * session, int32_t stream_id, uint8_t * buf, size_t length,
+		uint32_t * data_flags, nghttp2_data_source * source, void * user_data){
+		Http2Connection * self = (Http2Connection *)user_data;
+		auto it = self->streams.find(stream_id);
+		if(it == self->streams.end()){
+			return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+		}
+		Stream & stream = it->second;
+		size_t n = std::min(length, stream.body.size() - stream.offset);
+		memcpy(buf, stream.body.data() + stream.offset, n);
+		stream.offset += n;
+		if(stream.offset == stream.body.size()){
+			*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+		}
+		return n;
+	}
+
+	/**
+	 * turn a complete stream into an HTTP/1.1 request for GET and POST. The target is made
+	 * absolute, as a client of a forward proxy sends it, so both protocols share cache keys
+	 * @param stream the stream, its request is moved out
+	 * @return the request, allocated outside of any connection arena
+	*/
+	arena_request * toRequest(Stream * stream){
+		arena_request * request = new arena_request(std::move(stream->request));
+		http::verb method = http::string_to_verb(stream->method);
+		if(method == http::verb::unknown){
+			request->method_string(stream->method);
+		}else{
+			request->method(method);
+		}
+		if(stream->authority.empty() && request->find(http::field::host) != request->end()){
+			stream->authority = std::string((*request)[http::field::host]);
+		}
+		if(!stream->authority.empty()){
+			request->set(http::field::host, stream->authority);
+		}
+		request->target(stream->scheme + "://" + stream->authority + stream->path);
+		request->version(11);
+		request->prepare_payload();
+		return request;
+	}
+
+	/**
+	 * serve a request on a thread of its own, the response is posted to the outbox
+	 * @param stream_id id of the stream
+	 * @param request the request, deleted by the thread
+	*/
+	void start(int32_t stream_id, arena_request * request){
+		std::shared_ptr<Http2Outbox> box = outbox;
+		Handler serve = handler;
+		std::thread t([box, serve, stream_id, request](){
+			http::response<http::dynamic_body> * response = new http::response<http::dynamic_body>();
+			serve(request, response);
+			delete request;
+			box->post(stream_id, response);
+		});
+		t.detach();
+	}
+
+	/**
+	 * submit the responses finished since the last call, nghttp2 sends them as the
+	 * flow control windows and the priorities of the streams allow
+	*/
+	void submitReady(){
+		char tokens[64];
+		if(read(outbox->wake[0], tokens, sizeof(tokens)) < 0 && errno != EAGAIN){
+			return;
+		}
+		std::deque<std::pair<int32_t, http::response<http::dynamic_body> *> > ready;
+		pthread_mutex_lock(&outbox->lock);
+		ready.swap(outbox->ready);
+		pthread_mutex_unlock(&outbox->lock);
+		for(size_t i = 0; i < ready.size(); i++){
+			submit(ready[i].first, ready[i].second);
+			delete ready[i].second;
+		}
+	}
+
+	/**
+	 * submit the response of a stream, unless the client has reset the stream meanwhile.
+	 * Field names are lower-cased and the HTTP/1.1 connection fields dropped, as HTTP/2 requires
+	*/
+	void submit(int32_t stream_id, http::response<http::dynamic_body> * response){
+		auto it = streams.find(stream_id);
+		if(it == streams.end()){
+			return;
+		}
+		Stream & stream = it->second;
+		std::string status = std::to_string(response->result_int());
+		std::vector<std::string> names;
+		std::vector<beast::string_view> values;
+		for(auto & field : *response){
+			std::string name(field.name_string());
+			for(size_t i = 0; i < name.size(); i++){
+				name[i] = tolower((unsigned char)name[i]);
+			}
+			if(name == "connection" || name == "keep-alive" || name == "proxy-connection"
+				|| name == "transfer-encoding" || name == "upgrade"){
+				continue;
+			}
+			names.push_back(name);
+			values.push_back(field.value());
+		}
+		std::vector<nghttp2_nv> nva;
+		nva.push_back(nghttp2_nv{(uint8_t *)":status", (uint8_t *)status.data(), 7, status.size(), NGHTTP2_NV_FLAG_NONE});
+		for(size_t i = 0; i < names.size(); i++){
+			nva.push_back(nghttp2_nv{(uint8_t *)names[i].data(), (uint8_t *)values[i].data(), names[i].size(), values[i].size(), NGHTTP2_NV_FLAG_NONE});
+		}
+		stream.body = beast::buffers_to_string(response->body().data());
+		stream.offset = 0;
+		nghttp2_data_provider provider;
+		provider.source.ptr = NULL;
+		provider.read_callback = onRead;
+		nghttp2_submit_response(session, stream_id, nva.data(), nva.size(), stream.body.empty() ? NULL : &provider);
+	}
+
+	/**
+	 * decode the HTTP2-Settings field of an upgrade request, base64url without padding
+	*/
+	static std::string decodeSettings(beast::string_view str){
+		std::string out;
+		unsigned bits = 0;
+		int count = 0;
+		for(size_t i = 0; i < str.size(); i++){
+			char c = str[i];
+			int v;
+			if(c >= 'A' && c <= 'Z'){
+				v = c - 'A';
+			}else if(c >= 'a' && c <= 'z'){
+				v = c - 'a' + 26;
+			}else if(c >= '0' && c <= '9'){
+				v = c - '0' + 52;
+			}else if(c == '-' || c == '+'){
+				v = 62;
+			}else if(c == '_' || c == '/'){
+				v = 63;
+			}else{
+				continue;
+			}
+			bits = (bits << 6) | v;
+			count += 6;
+			if(count >= 8){
+				count -= 8;
+				out.push_back((char)((bits >> count) & 0xFF));
+			}
+		}
+		return out;
+	}
+
+public:
+	/**
+	 * @param c client connection, already read up to the HTTP/2 connection preface
+	 * @param h serves the request of every stream
+	*/
+	Http2Connection(ClientStream * c, Handler h):client(c), handler(h), session(NULL), outbox(new Http2Outbox()){}
+
+	~Http2Connection(){
+		pthread_mutex_lock(&outbox->lock);
+		outbox->closed = true;
+		pthread_mutex_unlock(&outbox->lock);
+		if(session != NULL){
+			nghttp2_session_del(session);
+		}
+	}
+
+	/**
+	 * whether an HTTP/1.1 request asks to switch the connection to h2c
+	 * @param request request get from client
+	*/
+	template<class Request>
+	static bool wantsUpgrade(Request * request){
+		if(request->find(http::field::upgrade) == request->end() || request->find("HTTP2-Settings") == request->end()){
+			return false;
+		}
+		//nghttp2 takes over the request without a body only
+		if(request->body().size() != 0){
+			return false;
+		}
+		return (*request)[http::field::upgrade].find("h2c") != beast::string_view::npos;
+	}
+
+	/**
+	 * serve the connection until the client closes it or it fails
+	 * @param upgrade the HTTP/1.1 request that asked for h2c, it is answered on stream 1;
+	 *        NULL if the client started with HTTP/2 (prior knowledge)
+	*/
+	void run(arena_request * upgrade){
+		nghttp2_session_callbacks * callbacks;
+		if(nghttp2_session_callbacks_new(&callbacks) != 0){
+			return;
+		}
+		nghttp2_session_callbacks_set_send_callback(callbacks, onSend);
+		nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, onBeginHeaders);
+		nghttp2_session_callbacks_set_on_header_callback(callbacks, onHeader);
+		nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, onDataChunk);
+		nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, onFrameRecv);
+		nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, onStreamClose);
+		int rv = nghttp2_session_server_new(&session, callbacks, this);
+		nghttp2_session_callbacks_del(callbacks);
+		if(rv != 0){
+			session = NULL;
+			return;
+		}
+		nghttp2_settings_entry settings = {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS};
+		nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, &settings, 1);
+		if(upgrade != NULL){
+			std::string payload = decodeSettings((*upgrade)["HTTP2-Settings"]);
+			int head = upgrade->method() == http::verb::head;
+			if(nghttp2_session_upgrade2(session, (const uint8_t *)payload.data(), payload.size(), head, NULL) != 0){
+				return;
+			}
+			//copied out of the connection arena, the thread serving it may outlive this connection
+			arena_request * request = new arena_request();
+			request->base() = upgrade->base();
+			request->body() = upgrade->body();
+			request->erase(http::field::upgrade);
+			request->erase(http::field::connection);
+			request->erase("HTTP2-Settings");
+			if(request->target().starts_with("/") && request->find(http::field::host) != request->end()){
+				request->target("http://" + std::string((*request)[http::field::host]) + std::string(request->target()));
+			}
+			streams[1].started = true;
+			start(1, request);
+		}
+
+		int fd = client->socket->native_handle();
+		struct pollfd fds[2];
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = outbox->wake[0];
+		fds[1].events = POLLIN;
+		uint8_t buffer[H2_READ_CHUNK];
+		while(true){
+			if(nghttp2_session_send(session) != 0){
+				break;
+			}
+			if(!nghttp2_session_want_read(session) && !nghttp2_session_want_write(session)){
+				break;
+			}
+			if(poll(fds, 2, -1) < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				break;
+			}
+			if(fds[1].revents != 0){
+				submitReady();
+			}
+			if(fds[0].revents != 0){
+				boost::system::error_code ec;
+				size_t n = client->read_some(net::buffer(buffer), ec);
+				if(ec.value() != 0 || nghttp2_session_mem_recv(session, buffer, n) < 0){
+					break;
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,558 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <stdexcept>
+#include <system_error>
+
+#define URING_ENTRIES 16        //submission queue size of the ring of each thread
+#define SEND_MAX_BUFFERS 8      //buffers sent by one call to send, one linked chain with io_uring
+
+/**
+ * the system calls that move the bytes of client connections: accept, recv, send and splice.
+ * They fail like the system calls do, with -1 and errno set
+*/
+class Transport{
+public:
+	virtual ~Transport(){}
+
+	/**
+	 * name of the backend, for the log
+	*/
+	virtual const char * name() = 0;
+
+	/**
+	 * wait for the next connection on a listening socket
+	 * @return the connected socket
+	*/
+	virtual int accept(int listen_fd) = 0;
+
+	/**
+	 * receive what is available on a socket, waiting if nothing is
+	 * @return bytes received, 0 at the end of data
+	*/
+	virtual ssize_t recv(int fd, void * data, size_t length) = 0;
+
+	/**
+	 * send all the bytes of a list of buffers
+	 * @param iov the buffers, at most SEND_MAX_BUFFERS
+	 * @return bytes sent, all of them unless -1
+	*/
+	virtual ssize_t send(int fd, const struct iovec * iov, int count) = 0;
+
+	/**
+	 * move up to length bytes between a socket and a pipe without copying them into the proxy
+	 * @return bytes moved, 0 at the end of data
+	*/
+	virtual ssize_t splice(int from, int to, size_t length) = 0;
+};
+
+/**
+ * the default backend: one blocking system call per operation, as Asio makes them
+*/
+class SocketTransport : public Transport{
+public:
+	const char * name(){
+		return "socket";
+	}
+
+	int accept(int listen_fd){
+		int fd;
+		do{
+			fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		}while(fd < 0 && errno == EINTR);
+		return fd;
+	}
+
+	ssize_t recv(int fd, void * data, size_t length){
+		ssize_t n;
+		do{
+			n = ::recv(fd, data, length, 0);
+		}while(n < 0 && errno == EINTR);
+		return n;
+	}
+
+	ssize_t send(int fd, const struct iovec * iov, int count){
+		struct iovec rest[SEND_MAX_BUFFERS];
+		memcpy(rest, iov, count * sizeof(struct iovec));
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = rest;
+		message.msg_iovlen = count;
+		ssize_t total = 0;
+		while(message.msg_iovlen > 0){
+			ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+			if(n < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				return -1;
+			}
+			total += n;
+			//skip what was sent
+			while(message.msg_iovlen > 0 && (size_t)n >= message.msg_iov->iov_len){
+				n -= message.msg_iov->iov_len;
+				message.msg_iov++;
+				message.msg_iovlen--;
+			}
+			if(message.msg_iovlen > 0){
+				message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + n;
+				message.msg_iov->iov_len -= n;
+			}
+		}
+		return total;
+	}
+
+	ssize_t splice(int from, int to, size_t length){
+		return ::splice(from, NULL, to, NULL, length, SPLICE_F_MOVE);
+	}
+};
+
+/**
+ * the io_uring backend, selected with PROXY_TRANSPORT=uring. Every thread uses a ring of its own,
+ * taken from the rings of ended threads or set up on first use. The accept thread keeps one multishot accept armed, so connections that
+ * arrive together are taken from the completion queue without a system call each; the buffers
+ * of a send go out as one chain of linked sends, submitted with a single system call.
+*/
+class UringTransport : public Transport{
+private:
+	/**
+	 * one io_uring with its queues mapped, used by a single thread
+	 * @param sq_*, cq_* the shared head, tail, mask and arrays of the submission and completion queue
+	 * @param queued submission entries prepared since the tail was last published
+	 * @param accepting an accept is armed on this ring
+	*/
+	class Ring{
+	public:
+		int fd = -1;
+		void * sq_ptr = MAP_FAILED;
+		void * cq_ptr = MAP_FAILED;
+		size_t sq_size = 0;
+		size_t cq_size = 0;
+		struct io_uring_sqe * sqes = (struct io_uring_sqe *)MAP_FAILED;
+		size_t sqes_size = 0;
+		unsigned * sq_head;
+		unsigned * sq_tail;
+		unsigned * sq_mask;
+		unsigned * sq_array;
+		unsigned * cq_head;
+		unsigned * cq_tail;
+		unsigned * cq_mask;
+		struct io_uring_cqe * cqes;
+		unsigned queued = 0;
+		bool accepting = false;
+
+		Ring(unsigned entries){
+			struct io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			// completions are only reaped in io_uring_enter, so the kernel need not interrupt the thread
+			params.flags = IORING_SETUP_COOP_TASKRUN;
+			fd = syscall(__NR_io_uring_setup, entries, &params);
+			if(fd < 0 && errno == EINVAL){
+				// kernels before 5.19
+				memset(&params, 0, sizeof(params));
+				fd = syscall(__NR_io_uring_setup, entries, &params);
+			}
+			if(fd < 0){
+				throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+			}
+			sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+			if(single){
+				sq_size = cq_size = std::max(sq_size, cq_size);
+			}
+			sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if(sq_ptr != MAP_FAILED){
+				cq_ptr = single ? sq_ptr : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			}
+			if(cq_ptr != MAP_FAILED){
+				sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+				sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			}
+			if(sqes == MAP_FAILED){
+				int error = errno;
+				release();
+				throw std::system_error(error, std::generic_category(), "cannot map io_uring queues");
+			}
+			char * sq = (char *)sq_ptr;
+			char * cq = (char *)cq_ptr;
+			sq_head = (unsigned *)(sq + params.sq_off.head);
+			sq_tail = (unsigned *)(sq + params.sq_off.tail);
+			sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+			sq_array = (unsigned *)(sq + params.sq_off.array);
+			cq_head = (unsigned *)(cq + params.cq_off.head);
+			cq_tail = (unsigned *)(cq + params.cq_off.tail);
+			cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+			cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+		}
+
+		~Ring(){
+			release();
+		}
+
+		void release(){
+			if(sqes != MAP_FAILED){
+				munmap(sqes, sqes_size);
+			}
+			if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr){
+				munmap(cq_ptr, cq_size);
+			}
+			if(sq_ptr != MAP_FAILED){
+				munmap(sq_ptr, sq_size);
+			}
+			if(fd >= 0){
+				close(fd);
+			}
+		}
+
+		/**
+		 * a cleared submission entry, handed to the kernel by the next wait
+		*/
+		struct io_uring_sqe * next(){
+			unsigned index = (*sq_tail + queued) & *sq_mask;
+			queued++;
+			struct io_uring_sqe * sqe = &sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sq_array[index] = index;
+			return sqe;
+		}
+
+		/**
+		 * take one completion if there is one
+		*/
+		bool peek(struct io_uring_cqe * cqe){
+			unsigned head = *cq_head;
+			if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+				return false;
+			}
+			*cqe = cqes[head & *cq_mask];
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		/**
+		 * submit what was prepared and take the next completion, waiting for it if needed
+		*/
+		struct io_uring_cqe wait(){
+			if(queued > 0){
+				__atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+				queued = 0;
+			}
+			struct io_uring_cqe cqe;
+			while(true){
+				unsigned unsubmitted = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+				if(unsubmitted == 0 && peek(&cqe)){
+					return cqe;
+				}
+				if(syscall(__NR_io_uring_enter, fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+					&& errno != EINTR && errno != EAGAIN && errno != EBUSY){
+					throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+				}
+			}
+		}
+	};
+
+	/**
+	 * rings given back by threads that ended, every operation is complete when a thread gives
+	 * its ring back, so the next thread can take it over as it is
+	*/
+	inline static std::vector<Ring *> idle_rings;
+	inline static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/**
+	 * holds the ring of a thread and gives it back when the thread ends
+	*/
+	struct Lease{
+		Ring * ring = NULL;
+		~Lease(){
+			if(ring != NULL){
+				pthread_mutex_lock(&idle_lock);
+				idle_rings.push_back(ring);
+				pthread_mutex_unlock(&idle_lock);
+			}
+		}
+	};
+
+	static Lease & lease(){
+		static thread_local Lease held;
+		return held;
+	}
+
+	/**
+	 * the ring of the calling thread, a connection thread would otherwise pay
+	 * for setting up and tearing down a ring of its own
+	*/
+	static Ring * ring(){
+		Lease & lease = UringTransport::lease();
+		if(lease.ring == NULL){
+			pthread_mutex_lock(&idle_lock);
+			if(!idle_rings.empty()){
+				lease.ring = idle_rings.back();
+				idle_rings.pop_back();
+			}
+			pthread_mutex_unlock(&idle_lock);
+			if(lease.ring == NULL){
+				lease.ring = new Ring(URING_ENTRIES);
+			}
+		}
+		return lease.ring;
+	}
+
+	/**
+	 * the result of a completion the way a system call returns it
+	*/
+	static ssize_t result(int res){
+		if(res < 0){
+			errno = -res;
+			return -1;
+		}
+		return res;
+	}
+
+	/**
+	 * a failure of the ring itself reported like a failed system call. The ring of the thread is
+	 * dropped, closing it ends what is still queued on it, and the next call sets up a new one
+	*/
+	static ssize_t failed(const std::system_error & e){
+		Lease & lease = UringTransport::lease();
+		delete lease.ring;
+		lease.ring = NULL;
+		errno = e.code().value();
+		return -1;
+	}
+
+	/**
+	 * one accept submission takes every connection, false once the kernel refused that
+	*/
+	bool multishot = true;
+
+public:
+	/**
+	 * set up the ring of the calling thread, throws std::runtime_error if the kernel refuses or
+	 * lacks one of the operations used here
+	*/
+	UringTransport(){
+		Ring * r = ring();
+		size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+		struct io_uring_probe * probe = (struct io_uring_probe *)calloc(1, size);
+		if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) < 0){
+			int error = errno;
+			free(probe);
+			throw std::system_error(error, std::generic_category(), "io_uring probe");
+		}
+		//RECV and SEND came with kernel 5.6, SPLICE with 5.7
+		const int used[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SPLICE};
+		for(int op : used){
+			if(op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)){
+				free(probe);
+				throw std::system_error(EOPNOTSUPP, std::generic_category(), "io_uring operation " + std::to_string(op));
+			}
+		}
+		free(probe);
+	}
+
+	const char * name(){
+		return "io_uring";
+	}
+
+	int accept(int listen_fd){
+		try{
+			Ring * r = ring();
+			if(!r->accepting){
+				struct io_uring_sqe * sqe = r->next();
+				sqe->opcode = IORING_OP_ACCEPT;
+				sqe->fd = listen_fd;
+				if(multishot){
+					sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+				}
+				sqe->accept_flags = SOCK_CLOEXEC;
+				r->accepting = true;
+			}
+			struct io_uring_cqe cqe = r->wait();
+			//the kernel ends a multishot accept on errors, it is armed again by the next call
+			if(!(cqe.flags & IORING_CQE_F_MORE)){
+				r->accepting = false;
+			}
+			if(cqe.res == -EINVAL && multishot){
+				//kernels before 5.19 refuse a multishot accept, one accept is submitted per connection from now on
+				multishot = false;
+				return accept(listen_fd);
+			}
+			return result(cqe.res);
+		}catch(std::system_error & e){
+			return failed(e);
+		}
+	}
+
+	ssize_t recv(int fd, void * data, size_t length){
+		try{
+			Ring * r = ring();
+			struct io_uring_sqe * sqe = r->next();
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long)data;
+			sqe->len = length;
+			return result(r->wait().res);
+		}catch(std::system_error & e){
+			return failed(e);
+		}
+	}
+
+	ssize_t send(int fd, const struct iovec * iov, int count){
+		try{
+			Ring * r = ring();
+			struct iovec rest[SEND_MAX_BUFFERS];
+			memcpy(rest, iov, count * sizeof(struct iovec));
+			ssize_t total = 0;
+			int first = 0;
+			while(first < count){
+				//one linked chain: a send starts only after the one before it sent everything,
+				//a short or failed send cancels the rest of the chain
+				for(int i = first; i < count; i++){
+					struct io_uring_sqe * sqe = r->next();
+					sqe->opcode = IORING_OP_SEND;
+					sqe->fd = fd;
+					sqe->addr = (unsigned long)rest[i].iov_base;
+					sqe->len = rest[i].iov_len;
+					sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+					sqe->user_data = i;
+					if(i != count - 1){
+						sqe->flags = IOSQE_IO_LINK;
+					}
+				}
+				int results[SEND_MAX_BUFFERS];
+				for(int i = first; i < count; i++){
+					struct io_uring_cqe cqe = r->wait();
+					results[cqe.user_data] = cqe.res;
+				}
+				int done = first;
+				while(done < count && results[done] == (int)rest[done].iov_len){
+					total += results[done];
+					done++;
+				}
+				if(done < count){
+					int res = results[done];
+					if(res == 0){
+						return result(-EPIPE);
+					}
+					if(res < 0 && res != -ECANCELED){
+						return result(res);
+					}
+					if(res > 0){
+						//short send, the rest of this buffer goes with the next chain
+						total += res;
+						rest[done].iov_base = (char *)rest[done].iov_base + res;
+						rest[done].iov_len -= res;
+					}
+				}
+				first = done;
+			}
+			return total;
+		}catch(std::system_error & e){
+			return failed(e);
+		}
+	}
+
+	ssize_t splice(int from, int to, size_t length){
+		try{
+			Ring * r = ring();
+			struct io_uring_sqe * sqe = r->next();
+			sqe->opcode = IORING_OP_SPLICE;
+			sqe->fd = to;
+			sqe->off = (unsigned long long)-1;
+			sqe->splice_fd_in = from;
+			sqe->splice_off_in = (unsigned long long)-1;
+			sqe->len = length;
+			sqe->splice_flags = SPLICE_F_MOVE;
+			return result(r->wait().res);
+		}catch(std::system_error & e){
+			return failed(e);
+		}
+	}
+};
+
+/**
+ * a client connection as a Beast stream, its bytes go through the transport of the proxy
+*/
+class ClientStream{
+public:
+	tcp::socket * socket;
+	Transport * transport;
+
+	ClientStream(tcp::socket * s, Transport * t):socket(s), transport(t){}
+
+	template<class MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence & buffers){
+		boost::system::error_code ec;
+		size_t n = read_some(buffers, ec);
+		if(ec){
+			throw boost::system::system_error(ec);
+		}
+		return n;
+	}
+
+	template<class MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence & buffers, boost::system::error_code & ec){
+		ec = {};
+		for(auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers); ++it){
+			net::mutable_buffer buffer = *it;
+			if(buffer.size() == 0){
+				continue;
+			}
+			ssize_t n = transport->recv(socket->native_handle(), buffer.data(), buffer.size());
+			if(n < 0){
+				ec.assign(errno, boost::system::system_category());
+				return 0;
+			}
+			if(n == 0){
+				ec = net::error::eof;
+			}
+			return n;
+		}
+		return 0;
+	}
+
+	template<class ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence & buffers){
+		boost::system::error_code ec;
+		size_t n = write_some(buffers, ec);
+		if(ec){
+			throw boost::system::system_error(ec);
+		}
+		return n;
+	}
+
+	template<class ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence & buffers, boost::system::error_code & ec){
+		ec = {};
+		struct iovec iov[SEND_MAX_BUFFERS];
+		int count = 0;
+		for(auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers) && count < SEND_MAX_BUFFERS; ++it){
+			net::const_buffer buffer = *it;
+			if(buffer.size() == 0){
+				continue;
+			}
+			iov[count].iov_base = (void *)buffer.data();
+			iov[count].iov_len = buffer.size();
+			count++;
+		}
+		if(count == 0){
+			return 0;
+		}
+		ssize_t n = transport->send(socket->native_handle(), iov, count);
+		if(n < 0){
+			ec.assign(errno, boost::system::system_category());
+			return 0;
+		}
+		return n;
+	}
+};
@@ -0,0 +1,33 @@
+# compare the socket and io_uring transports
+# usage: bash bench-transport.sh url [requests [parallel]]
+# url should be cacheable, so the scenario measures the proxy rather than the server:
+# it is fetched once to fill the cache, then requested again and again through the proxy
+# every request is a new connection (accept, recv, send); needs curl 7.66 or newer
+url=$1
+requests=${2:-5000}
+parallel=${3:-50}
+port=12399
+if [ -z "$url" ]
+then
+    echo "usage: $0 url [requests [parallel]]"
+    exit 1
+fi
+make
+args=""
+for i in $(seq 1 $requests)
+do
+    args="$args -o /dev/null $url"
+done
+for transport in socket uring
+do
+    PROXY_TRANSPORT=$transport PROXY_LOG=/tmp/bench-$transport.log ./proxy $port
+    sleep 0.5
+    pid=$(pgrep -n -x proxy)
+    curl -s -x http://127.0.0.1:$port -o /dev/null $url
+    start=$(date +%s.%N)
+    curl -s -x http://127.0.0.1:$port -Z --parallel-max $parallel -w "%{http_code}\n" $args | sort | uniq -c
+    end=$(date +%s.%N)
+    kill $pid
+    awk -v t=$transport -v n=$requests -v s=$start -v e=$end 'BEGIN { printf "%s: %d requests in %.2f s, %.0f requests/s\n", t, n, e - s, n / (e - s) }'
+    head -1 /tmp/bench-$transport.log
+done
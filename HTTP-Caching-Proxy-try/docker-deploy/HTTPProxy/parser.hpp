@@ -7,6 +7,9 @@
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
+#include <map>
+#include <vector>
 #include <string>
 #include <thread>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -24,12 +27,22 @@ using tcp = boost::asio::ip::tcp;
 namespace pt = boost::posix_time;
 namespace dt = boost::date_time;
 
-time_t parseDatetime(std::string date_str){
-    std::string format_str = "%a, %d %b %Y %H:%M:%S GMT";
+//Cache-Control directive -> value (-1 if the directive has no value)
+typedef std::pmr::map<std::pmr::string, long, std::less<> > field_map;
+
+time_t parseDatetime(beast::string_view date_str){
+    const char * format_str = "%a, %d %b %Y %H:%M:%S GMT";
+    //strptime needs a terminated string, HTTP-dates are 29 characters
+    char date_buf[64];
+    if(date_str.size() >= sizeof(date_buf)){
+        throw std::invalid_argument("Unable to parse datetime");
+    }
+    date_str.copy(date_buf, date_str.size());
+    date_buf[date_str.size()] = '\0';
 
     tm tm;
     tm.tm_isdst = 0;
-    if (strptime(date_str.c_str(), format_str.c_str(), &tm) == NULL) {
+    if (strptime(date_buf, format_str, &tm) == NULL) {
         std::cerr << "Failed to parse HTTP-date string" << std::endl;
         throw std::invalid_argument("Unable to parse datetime");
     }
@@ -41,32 +54,52 @@ time_t parseDatetime(std::string date_str){
     return time;
 }
 
-std::vector<std::string> split(std::string str_, char delimiter){
-    std::string str = "";
-    for(int i = 0; i < str_.size(); i++){
+/**
+ * current time, in the same GMT-as-local representation parseDatetime returns
+*/
+time_t gmtNow(){
+    time_t now;
+    time(&now);
+    return mktime(gmtime(&now));
+}
+
+/**
+ * inverse of parseDatetime, format a time as an HTTP-date string
+*/
+std::string formatDatetime(time_t time){
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", localtime(&time));
+    return std::string(buf);
+}
+
+std::pmr::vector<std::pmr::string> split(beast::string_view str_, char delimiter, std::pmr::memory_resource * mr = std::pmr::get_default_resource()){
+    std::pmr::string str(mr);
+    for(size_t i = 0; i < str_.size(); i++){
         if(str_[i]!=' '){
             str+=str_[i];
         }
     }
 
-    std::vector<std::string> result;
+    std::pmr::vector<std::pmr::string> result(mr);
     size_t start = 0, end = 0;
     while ((end = str.find(delimiter, start)) != std::string::npos) {
-        result.push_back(str.substr(start, end - start));
+        result.emplace_back(str.data() + start, end - start);
         start = end + 1;
     }
-    result.push_back(str.substr(start));
+    result.emplace_back(str.data() + start, str.size() - start);
     return result;
 }
 
-std::map<std::string, long> parseFields(std::string & str){
-    std::map<std::string, long> result;
-    std::vector<std::string> fields = split(str, ',');
-    int end;
-    for(int i  = 0; i < fields.size(); i++){
-        end = 0;
+field_map parseFields(beast::string_view str, std::pmr::memory_resource * mr = std::pmr::get_default_resource()){
+    field_map result(mr);
+    std::pmr::vector<std::pmr::string> fields = split(str, ',', mr);
+    size_t end;
+    for(size_t i  = 0; i < fields.size(); i++){
+        if(fields[i].empty()){
+            continue;
+        }
         if((end= fields[i].find('=', 0)) != std::string::npos){
-            result[fields[i].substr(0, end)] = std::stol(fields[i].substr(end+1),NULL,10);
+            result[std::pmr::string(fields[i].data(), end, mr)] = strtol(fields[i].c_str() + end + 1, NULL, 10);
         }else{
             result[fields[i]] = -1;
         }
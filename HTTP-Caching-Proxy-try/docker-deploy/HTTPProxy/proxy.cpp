@@ -1,34 +1,95 @@
 #include "Cache.hpp"  
+#include "Arena.hpp"
+#include "Transport.hpp"
+#include "Cluster.hpp"
+#ifdef HAVE_NGHTTP2
+#include "Http2.hpp"
+#endif
+#include <atomic>
 #include <exception>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <unistd.h>
+
+#define NEGATIVE_TTL 10         //seconds to remember origin 5xx and connect failures
+#define HEURISTIC_FRACTION 10   //heuristic freshness is (Date - Last-Modified) / 10
+#define HEURISTIC_MAX 86400     //heuristic freshness never exceeds one day
+#define TUNNEL_CHUNK 65536      //max bytes moved by one splice in a CONNECT tunnel
+#define ARENA_SIZE 16384        //stack bytes of the per-connection arena before it falls back to the heap
+
 class Proxy{
 private:
     const char * host;
-    const char * port;
+    std::string port;
     boost::asio::io_context io_context;
-    int id = 0; //request id
-    std::ofstream LogStream = std::ofstream("/var/log/erss/proxy.log");
+    std::atomic<int> id{0}; //request id
+    //PROXY_LOG lets several proxies on one machine keep separate logs
+    std::ofstream LogStream = std::ofstream(getenv("PROXY_LOG") != NULL ? getenv("PROXY_LOG") : "/var/log/erss/proxy.log");
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     Cache cache;
+    Cluster cluster;
+    Transport * transport;
+    //arena of the connection served by this thread, set by requestProcess
+    inline static thread_local std::pmr::memory_resource * connection_arena = NULL;
+    //set while this thread serves an HTTP/2 stream, whose responses are built as HTTP/1.1
+    inline static thread_local bool serving_stream = false;
 
 public:
-    Proxy(std::string p, int c):host(NULL), port(p.c_str()), cache(Cache(c, &lock, &LogStream)){}
+    /**
+     * @param p port to listen on
+     * @param c capacity of the cache
+     * @param self name of this proxy in the cluster, "host:port"
+     * @param peers names of the other proxies of the cluster, empty to run alone
+    */
+    Proxy(std::string p, int c, std::string self, std::vector<std::string> peers):host(NULL), port(p), cache(Cache(c, getenv("PROXY_COMPRESS") != NULL, &lock, &LogStream)),
+        cluster(io_context, self, peers, &lock, &LogStream), transport(makeTransport()){}
+
+    /**
+     * the transport selected with PROXY_TRANSPORT: "uring" for io_uring, the plain
+     * system calls otherwise or when the kernel does not allow io_uring
+    */
+    Transport * makeTransport(){
+        const char * name = getenv("PROXY_TRANSPORT");
+        if(name != NULL && strcmp(name, "uring") == 0){
+            try{
+                return new UringTransport();
+            }catch(std::runtime_error & e){
+                pthread_mutex_lock(&lock);
+                LogStream<<"(no-id): WARNING io_uring not available ("<<e.what()<<"), using sockets"<<std::endl;
+                pthread_mutex_unlock(&lock);
+            }
+        }
+        return new SocketTransport();
+    }
 
     void run(){
         boost::system::error_code ec;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), strtol(port, NULL, 0)));
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), strtol(port.c_str(), NULL, 0)));
+        if(cluster.enabled()){
+            std::thread health(&Cluster::healthLoop, &cluster);
+            health.detach();
+        }
+        pthread_mutex_lock(&lock);
+        LogStream<<"(no-id): NOTE "<<transport->name()<<" transport"<<std::endl;
+        pthread_mutex_unlock(&lock);
         while (true){
             //accept client connection
+            int fd = transport->accept(acceptor.native_handle());
+            if(fd < 0){
+                //if cannot connect, go to next connection
+                // std::cerr<<"cannot connect with client: "<< strerror(errno)<<std::endl;
+                continue;
+            }
             tcp::socket * socket = new tcp::socket(io_context);
-            acceptor.accept(*socket, ec);
-            id++;
+            socket->assign(tcp::v4(), fd, ec);
+            int ID = id++;
             if(ec.value() != 0){
-                //if cannot connect, go to next connection
-                // std::cerr<<"cannot connect with client: "<< ec.message()<<std::endl;
-                socket->close();
+                close(fd);
                 delete socket;
                 continue;
             }
-            std::thread t(&Proxy::requestProcess, this, socket, id-1);
+            std::thread t(&Proxy::requestProcess, this, socket, ID);
             t.detach();
         }
     }
@@ -53,30 +114,101 @@ public:
         return socket;
 };
 
+    /**
+     * memory for everything that lives only as long as the current connection
+     * @return the arena of the connection, or the default resource outside of one
+    */
+    std::pmr::memory_resource * arena(){
+        return connection_arena != NULL ? connection_arena : std::pmr::get_default_resource();
+    }
+
+    /**
+     * connect to the server named in the host field of the request, unless already connected
+     * a server that failed recently is not tried again before NEGATIVE_TTL passes
+     * @param request request get from client
+     * @param socket_server placeholder for the connection, left NULL on failure
+     * @return true if connected; false if not, the caller then answers the client with 502
+    */
+    bool openServer(arena_request * request, int ID, tcp::socket ** socket_server){
+        if(*socket_server != NULL){
+            return true;
+        }
+        std::string port;
+        std::string host;
+        isHTTPS(std::string(request->at("HOST")), &host, &port);
+        std::string server = host + ":" + port;
+        if(cache.isUnreachable(server)){
+            pthread_mutex_lock(&lock);
+            LogStream<<ID<<": ERROR Cannot connect to server (failed recently)"<<std::endl;
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        try{
+            *socket_server = connectToServer(host.c_str(), port.c_str());
+        }catch(std::exception & e){
+            // std::cerr<< "socket error:" <<e.what()<< std::endl;
+            cache.markUnreachable(server, gmtNow() + NEGATIVE_TTL);
+            pthread_mutex_lock(&lock);
+            LogStream<<ID<<": ERROR Cannot connect to server"<<std::endl;
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * serve one client connection. A client sends one request, a peer proxy keeps
+     * the connection open and sends one request after the other, an HTTP/2 client
+     * sends its requests on streams of the connection.
+     * the request, read buffers and temporary strings are allocated from an arena
+     * that starts on this thread's stack and is released at once after each request
+     * @param socket client connection
+     * @param ID id number of the current client
+    */
+    void requestProcess(tcp::socket * socket, int ID){
+        char arena_storage[ARENA_SIZE];
+        std::pmr::monotonic_buffer_resource arena(arena_storage, sizeof(arena_storage));
+        connection_arena = &arena;
+        ClientStream client(socket, transport);
+        if(startsHttp2(socket)){
+            serveHttp2(&client, NULL, ID);
+        }else{
+            while(handleRequest(&client, ID)){
+                arena.release();
+                ID = id++;
+            }
+        }
+        socket->close();
+        delete socket;
+    }
+
     /**
      * process incomming request from client:
      * POST
      * GET
      * CONNECT
      * @param socket client connection
-     * @param ID id number of the current client
+     * @param ID id number of the current request
+     * @return true if another request should be read from the connection; false to close it
     */
-    void requestProcess(tcp::socket * socket, int ID){
+    bool handleRequest(ClientStream * socket, int ID){
         boost::system::error_code ec;
-        net::ip::tcp::endpoint client_ip = socket->remote_endpoint();
+        //a connection reset before the next request on a kept connection is not an error
+        net::ip::tcp::endpoint client_ip = socket->socket->remote_endpoint(ec);
+        if(ec.value() != 0){
+            return false;
+        }
         time_t now;
         time(&now);
         time_t gmt_now = mktime(gmtime(&now));
         //read request from client
-        beast::flat_buffer buffer;
-        http::request<http::dynamic_body> request;
+        arena_buffer buffer{arena_alloc(arena())};
+        arena_request request(std::piecewise_construct, std::make_tuple(arena_alloc(arena())), std::make_tuple(arena_alloc(arena())));
         http::read(*socket, buffer, request, ec);
 
         //empty request, ignore
         if(ec.value() == 1){
-            socket->close();
-            delete socket;
-            return;
+            return false;
         }
         //error handle: if cannot read request, or request is not valid
         //send 400 to client and close this thread
@@ -95,9 +227,22 @@ public:
                 LogStream<<ID<<": Connection Lost"<<std::endl;
                 pthread_mutex_unlock(&lock);
             }
-            socket->close();
-            delete socket;
-            return;
+            return false;
+        }
+
+        //request sent by a peer proxy of the cluster, never forwarded to another peer;
+        //from any other client the header is dropped, it would skip the ring and the health check is not for them
+        bool from_peer = request.find(PEER_HEADER) != request.end() && cluster.isPeer(client_ip.address());
+        request.erase(PEER_HEADER);
+        if(from_peer){
+            if(request.method() == http::verb::options && request.target() == "*"){
+                //health check, answered without logging
+                http::response<http::empty_body> pong{http::status::ok, request.version()};
+                pong.keep_alive(request.keep_alive());
+                pong.prepare_payload();
+                http::write(*socket, pong, ec);
+                return ec.value() == 0 && request.keep_alive();
+            }
         }
 
         pthread_mutex_lock(&lock);
@@ -106,72 +251,186 @@ public:
         <<" @ "<<ctime(&gmt_now);
         pthread_mutex_unlock(&lock);
 
-        //connect to server
-        std::string port;
-        std::string host;
-        isHTTPS(std::string(request.at("HOST")), &host, &port);
-        tcp::socket * socket_server;
-        try{
-            socket_server = connectToServer(host.c_str(), port.c_str());
-        }catch(std::exception & e){
-            // std::cerr<< "socket error:" <<e.what()<< std::endl;
+#ifdef HAVE_NGHTTP2
+        //h2c upgrade, the request is answered on stream 1 of the HTTP/2 connection
+        if(!from_peer && Http2Connection::wantsUpgrade(&request)){
+            std::string message = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
             pthread_mutex_lock(&lock);
-            LogStream<<ID<<": ERROR Cannot connect to server"<<std::endl;
+            LogStream<<ID<<": Responding \"HTTP/1.1 101 Switching Protocols\""<<std::endl;
             pthread_mutex_unlock(&lock);
-            socket->close();
-            delete socket;
-            return;
+            net::write(*socket, net::buffer(message), ec);
+            if(ec.value() == 0){
+                serveHttp2(socket, &request, ID);
+            }
+            return false;
         }
-        http::verb method = request.method();
+#endif
+
+        //connect to server only when needed, a fresh cache hit never does
+        tcp::socket * socket_server = NULL;
+        bool kept = false;
+        if(request.method() == http::verb::connect){//CONNECT
+            if(openServer(&request, ID, &socket_server)){
+                try{
+                    CONNECT(&request,ID, socket,socket_server);
+                }catch(std::exception & e){
+                    //if connect method throw exception, tunnel closed 
+                    pthread_mutex_lock(&lock);
+                    LogStream<<ID<<": Tunnel closed"<<std::endl;
+                    pthread_mutex_unlock(&lock);
+                    // std::cerr<< "CONNECT error:" <<e.what()<< std::endl;
+                }
+            }else{
+                http::write(*socket, make502Response(&request, ID),ec);
+            }
+        }else{
+            kept = dispatch(&request, ID, socket, &socket_server, from_peer);
+        }
+        if(socket_server != NULL){
+            socket_server->close();
+            delete socket_server;
+        }
+        return kept && from_peer && request.keep_alive();
+    }
+
+    /**
+     * process a GET or POST request, any other method gets 400
+     * @param request request get from client
+     * @param socket connection to client, or the capture of an HTTP/2 stream
+     * @param socket_server connection to server, connected here when the server is needed
+     * @param from_peer true if a peer proxy sent the request
+     * @return true if the connection can carry another request; false if sending the response failed
+     * part way, the client may then have only part of it before the 502
+    */
+    template<class Client>
+    bool dispatch(arena_request * request, int ID, Client * socket, tcp::socket ** socket_server, bool from_peer){
+        boost::system::error_code ec;
+        http::verb method = request->method();
         if (method ==http::verb::get){ //GET
             try{
-                GET(&request,ID,  socket, socket_server);
+                GET(request,ID,  socket, socket_server, from_peer);
             }catch(std::exception & e){
                 // std::cerr<< "GET error:" <<e.what()<< std::endl;
                 //if GET method throw exception, send 502 to client
-                http::write(*socket, make502Response(&request, ID),ec);
+                http::write(*socket, make502Response(request, ID),ec);
                 pthread_mutex_lock(&lock);
                 LogStream<<ID<<": ERROR Connection Lost"<<std::endl;
                 pthread_mutex_unlock(&lock);
+                return false;
             }
         }
         else if(method == http::verb::post){//POST
-            try{
-                POST(&request,ID,  socket,socket_server);
-            }catch(std::exception & e){
-                //if GET method throw exception, send 502 to client
-                // std::cerr<< "POST error:" <<e.what()<< std::endl;
-                http::write(*socket, make502Response(&request, ID),ec);
-                pthread_mutex_lock(&lock);
-                LogStream<<ID<<": ERROR Connection Lost"<<std::endl;
-                pthread_mutex_unlock(&lock);
-                //connection lost or the reponse get from server is invalid
-            }
-
-        }else if(method == http::verb::connect){//CONNECT
-            try{
-                CONNECT(&request,ID, socket,socket_server);
-            }catch(std::exception & e){
-                //if connect method throw exception, tunnel closed 
-                pthread_mutex_lock(&lock);
-                LogStream<<ID<<": Tunnel closed"<<std::endl;
-                pthread_mutex_unlock(&lock);
-                // std::cerr<< "CONNECT error:" <<e.what()<< std::endl;
+            if(openServer(request, ID, socket_server)){
+                try{
+                    POST(request,ID,  socket,*socket_server);
+                }catch(std::exception & e){
+                    //if GET method throw exception, send 502 to client
+                    // std::cerr<< "POST error:" <<e.what()<< std::endl;
+                    http::write(*socket, make502Response(request, ID),ec);
+                    pthread_mutex_lock(&lock);
+                    LogStream<<ID<<": ERROR Connection Lost"<<std::endl;
+                    pthread_mutex_unlock(&lock);
+                    //connection lost or the reponse get from server is invalid
+                    return false;
+                }
+            }else{
+                http::write(*socket, make502Response(request, ID),ec);
             }
 
         }else{
             // if request method is not a valid type, should response 400
-            http::write(*socket, make400Response(&request, ID),ec);
+            http::write(*socket, make400Response(request, ID),ec);
             // std::cerr<<"Bad Request Type!!!"<<std::endl;
         }
-        socket->close();
-        socket_server->close();
-        delete socket;
-        delete socket_server;
+        return ec.value() == 0;
+    }
+
+    /**
+     * whether the client opens the connection with the HTTP/2 preface ("PRI * HTTP/2.0"),
+     * looked at without taking it off the socket
+     * @param socket client connection
+    */
+    bool startsHttp2(tcp::socket * socket){
+        char start[3];
+        ssize_t n = recv(socket->native_handle(), start, sizeof(start), MSG_PEEK | MSG_WAITALL);
+        return n == sizeof(start) && memcmp(start, "PRI", sizeof(start)) == 0;
+    }
 
-       
+#ifdef HAVE_NGHTTP2
+    /**
+     * serve an HTTP/2 connection. Each stream is served on a thread of its own by the
+     * same GET and POST as an HTTP/1 request, so a slow miss never holds up a hit
+     * @param socket client connection
+     * @param upgrade the HTTP/1.1 request that asked for h2c; NULL with prior knowledge
+     * @param ID id number of the connection, its streams get ids of their own
+    */
+    void serveHttp2(ClientStream * socket, arena_request * upgrade, int ID){
+        boost::system::error_code ec;
+        net::ip::tcp::endpoint client_ip = socket->socket->remote_endpoint(ec);
+        if(upgrade == NULL){
+            //the upgrade request was logged already, the preface of prior knowledge is logged like a request
+            time_t gmt_now = gmtNow();
+            pthread_mutex_lock(&lock);
+            LogStream<<ID<<": \"PRI * HTTP/2.0\" from " <<client_ip.address()\
+            <<" @ "<<ctime(&gmt_now);
+            pthread_mutex_unlock(&lock);
+        }
+        Http2Connection connection(socket, [this, client_ip](arena_request * request, http::response<http::dynamic_body> * response){
+            serveStream(request, client_ip, response);
+        });
+        connection.run(upgrade);
     }
 
+    /**
+     * serve the request of one HTTP/2 stream, runs on a thread of its own
+     * @param request request of the stream
+     * @param client_ip address of the client
+     * @param response placeholder for the response
+    */
+    void serveStream(arena_request * request, net::ip::tcp::endpoint client_ip, http::response<http::dynamic_body> * response){
+        int ID = id++;
+        serving_stream = true;
+        time_t gmt_now = gmtNow();
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": \""<<request->method_string()<<" "<<request->target()\
+        <<" HTTP/2\" from " <<client_ip.address()\
+        <<" @ "<<ctime(&gmt_now);
+        pthread_mutex_unlock(&lock);
+        if(request->find(http::field::host) == request->end()){
+            *response = make400Response(request, ID);
+            serving_stream = false;
+            return;
+        }
+        //peers speak HTTP/1.1, the header is never trusted here
+        request->erase(PEER_HEADER);
+        ResponseCapture client;
+        tcp::socket * socket_server = NULL;
+        dispatch(request, ID, &client, &socket_server, false);
+        if(socket_server != NULL){
+            socket_server->close();
+            delete socket_server;
+        }
+        beast::flat_buffer buffer;
+        boost::system::error_code ec;
+        http::read(client, buffer, *response, ec);
+        if(ec.value() != 0){
+            //nothing or a broken response was written, the server could not be reached
+            *response = make502Response(request, ID);
+        }
+        serving_stream = false;
+    }
+#else
+    /**
+     * built without nghttp2: a client opening with the HTTP/2 preface is not served,
+     * its connection is closed; an "Upgrade: h2c" is ignored and answered with HTTP/1.1
+    */
+    void serveHttp2(ClientStream * socket, arena_request * upgrade, int ID){
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": WARNING HTTP/2 client refused, built without nghttp2"<<std::endl;
+        pthread_mutex_unlock(&lock);
+    }
+#endif
+
     /**
      * see if a request is http or https, and get their host name and port
      * @param hostname host field of a request
@@ -191,6 +450,119 @@ public:
         return false;
     }
 
+    /**
+     * build the cache key of a request, hostname+target
+     * range requests get their own key so a 206 is never served for a full request
+     * @param request request get from client
+     * @return the key, allocated from the connection arena
+    */
+    std::pmr::string cacheKey(arena_request * request){
+        std::pmr::string key(arena());
+        beast::string_view host = (*request)[http::field::host];
+        beast::string_view target = request->target();
+        key.append(host.data(), host.size()).append(": ").append(target.data(), target.size());
+        if(request->find(http::field::range) != request->end()){
+            beast::string_view range = (*request)[http::field::range];
+            key.append(" [").append(range.data(), range.size()).append("]");
+        }
+        return key;
+    }
+
+    /**
+     * if a GET was recently answered by the server with 5xx, resend that response
+     * @param request request get from client
+     * @param socket connection to client
+     * @return true if a response was sent; false if the server should be asked
+    */
+    template<class Client>
+    bool serveNegative(arena_request * request, int ID, Client * socket){
+        std::pmr::string key = cacheKey(request);
+        http::response<http::dynamic_body> response;
+        if(!cache.getNegative(key, &response)){
+            return false;
+        }
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<< ": in cache, recent server error"<<std::endl;
+        LogStream<<ID<<": Responding \"" \
+        << clientVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
+        pthread_mutex_unlock(&lock);
+        boost::system::error_code ec;
+        http::write(*socket, response, ec);
+        return true;
+    }
+
+    /**
+     * read a response from the server. The hop-by-hop connection fields are dropped and
+     * a body delimited by the end of the connection gets a Content-Length, so the response
+     * can be sent on (and cached) independent of the server connection
+     * @param socket_server connection to server
+     * @param response placeholder for the response
+    */
+    void readResponse(tcp::socket * socket_server, http::response<http::dynamic_body> * response){
+        arena_buffer buffer{arena_alloc(arena())};
+        boost::beast::http::read(*socket_server, buffer, *response);
+        response->erase(http::field::connection);
+        response->erase(http::field::keep_alive);
+        if(!response->has_content_length() && !response->chunked()){
+            unsigned status = response->result_int();
+            if(status / 100 != 1 && status != 204 && status != 304){
+                response->content_length(response->body().size());
+            }
+        }
+    }
+
+    /**
+     * on a local miss in a cluster, ask the peer owning the key, it caches the response
+     * @param request request get from client
+     * @param socket connection to client
+     * @param key cache key of the request
+     * @return true if the peer answered and the response was sent; false if the server should be asked
+    */
+    template<class Client>
+    bool askPeer(arena_request * request, int ID, Client * socket, std::string_view key){
+        if(!cluster.enabled()){
+            return false;
+        }
+        std::string peer = cluster.owner(key);
+        if(peer == cluster.name()){
+            return false;
+        }
+        arena_request peer_request = *request;
+        peer_request.set(PEER_HEADER, cluster.name());
+        peer_request.keep_alive(true);
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": Requesting \""<<request->method()<<" "<<request->target()\
+        <<" "<<parseVersion(request->version())<<"\" from peer " << peer<<std::endl;
+        pthread_mutex_unlock(&lock);
+        arena_buffer buffer{arena_alloc(arena())};
+        http::response<http::dynamic_body> response;
+        bool timed_out;
+        if(!cluster.fetch(peer, peer_request, buffer, &response, &timed_out)){
+            //a timeout may only be a slow server behind the peer, the health checks decide whether the peer is down
+            if(timed_out){
+                pthread_mutex_lock(&lock);
+                LogStream<<ID<<": NOTE peer "<<peer<<" did not answer within "<<PEER_TIMEOUT<<" seconds"<<std::endl;
+                pthread_mutex_unlock(&lock);
+            }else{
+                cluster.markPeer(peer, false);
+            }
+            return false;
+        }
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": Received \"" \
+        << parseVersion(response.version())<< " " << response.result_int() <<" "<< response.reason() \
+        <<"\" from peer "<< peer<<std::endl;
+        pthread_mutex_unlock(&lock);
+        //the peer keeps its channel, the client connection is closed after this response
+        response.keep_alive(false);
+        http::write(*socket, response);
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": Responding \"" \
+        << clientVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
     /**
      * process post method, send request to server
      * read reponse from server and send it to client
@@ -198,63 +570,123 @@ public:
      * @param socket connection to client
      * @param socket_server connection to server
     */
-    void POST(http::request<http::dynamic_body> * request,int ID,  tcp::socket * socket, tcp::socket * socket_server){
+    template<class Client>
+    void POST(arena_request * request,int ID,  Client * socket, tcp::socket * socket_server){
         // boost::system::error_code ec;
 
         //send request to server
         http::write(*socket_server, *request);
         //recieve the HTTP response from the server
-        boost::beast::flat_buffer buffer;
         http::response<http::dynamic_body> response;
-        boost::beast::http::read(*socket_server, buffer, response);
+        readResponse(socket_server, &response);
         //send response to client
         http::write(*socket, response);
         pthread_mutex_lock(&lock);
          LogStream<<ID<<": Responding \"" \
-        << parseVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
+        << clientVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
         pthread_mutex_unlock(&lock);
     }
 
     /**
      * process CONNECT method, build a tunnel between client and server
-     * send data in buffer between them
+     * wait on both sockets with poll and move data through a pipe with splice,
+     * so the bytes never get copied into the proxy
      * @param request request get from client
      * @param socket connection to client
      * @param socket_server connection to server
     */
-    void CONNECT(http::request<http::dynamic_body> * request,int ID, tcp::socket * socket, tcp::socket * socket_server){
+    void CONNECT(arena_request * request,int ID, ClientStream * socket, tcp::socket * socket_server){
         //send success to client, build the tunnel
-        int status;
         std::string message = "HTTP/1.1 200 OK\r\n\r\n";
-         pthread_mutex_lock(&lock);
-         LogStream<<ID<<": Responding \"HTTP/1.1 200 OK\""<<std::endl;
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": Responding \"HTTP/1.1 200 OK\""<<std::endl;
         pthread_mutex_unlock(&lock);
-        status = net::write(*socket, net::buffer(message));
-        while(true){
-            //byte of data available to read from server
-            int server_byte = socket_server->available();
-            //byte of data available to read from client
-            int clinet_byte = socket->available();
-
-            //send message between client and server
-            if(server_byte > 0){
-                std::vector<char> bu1(server_byte);
-                net::read(*socket_server, net::buffer(bu1));
-                net::write(*socket, net::buffer(bu1));
+        net::write(*socket, net::buffer(message));
+
+        int client_fd = socket->socket->native_handle();
+        int server_fd = socket_server->native_handle();
+        //one pipe per direction: client -> server, server -> client
+        int to_server[2];
+        int to_client[2];
+        if(pipe2(to_server, O_CLOEXEC) != 0){
+            throw std::runtime_error("cannot create tunnel pipe");
+        }
+        if(pipe2(to_client, O_CLOEXEC) != 0){
+            close(to_server[0]);
+            close(to_server[1]);
+            throw std::runtime_error("cannot create tunnel pipe");
+        }
+        //a direction that saw its end of data is no longer polled (negative fd),
+        //the tunnel ends when both have or when either fails
+        struct pollfd fds[2];
+        fds[0].fd = client_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server_fd;
+        fds[1].events = POLLIN;
+        while(fds[0].fd >= 0 || fds[1].fd >= 0){
+            if(poll(fds, 2, -1) < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                break;
             }
-            if(clinet_byte > 0){
-                std::vector<char> bu2(clinet_byte);
-                net::read(*socket, net::buffer(bu2));
-                net::write(*socket_server, net::buffer(bu2));
+            if(fds[0].fd >= 0 && fds[0].revents != 0 && !tunnelForward(&fds[0], server_fd, to_server)){
+                break;
             }
-            //if connection is closed, break the loop
-            if(!socket_server->is_open()||!socket->is_open()){
-                pthread_mutex_lock(&lock);
-                LogStream<<ID<<": Tunnel closed"<<std::endl;
-                pthread_mutex_unlock(&lock);
+            if(fds[1].fd >= 0 && fds[1].revents != 0 && !tunnelForward(&fds[1], client_fd, to_client)){
                 break;
             }
         }
+        close(to_server[0]);
+        close(to_server[1]);
+        close(to_client[0]);
+        close(to_client[1]);
+        pthread_mutex_lock(&lock);
+        LogStream<<ID<<": Tunnel closed"<<std::endl;
+        pthread_mutex_unlock(&lock);
+    }
+
+    /**
+     * forward one direction of a tunnel. At the end of data (a half-close) the FIN is
+     * passed on with shutdown, so the other direction keeps working until it ends too
+     * @param from poll entry of the socket to read from, its fd is set to -1 at the end of data
+     * @param to socket to write to
+     * @param pipefd pipe used for this direction
+     * @return false on error; true if the tunnel goes on
+    */
+    bool tunnelForward(struct pollfd * from, int to, int pipefd[2]){
+        ssize_t n = tunnelSplice(from->fd, to, pipefd);
+        if(n < 0){
+            return false;
+        }
+        if(n == 0){
+            shutdown(to, SHUT_WR);
+            from->fd = -1;
+        }
+        return true;
+    }
+
+    /**
+     * move the data available on one socket to the other through a pipe
+     * @param from socket to read from, must be readable
+     * @param to socket to write to
+     * @param pipefd pipe used for this direction
+     * @return number of bytes moved, 0 if from is closed, -1 on error
+    */
+    ssize_t tunnelSplice(int from, int to, int pipefd[2]){
+        ssize_t n = transport->splice(from, pipefd[1], TUNNEL_CHUNK);
+        if(n <= 0){
+            return n;
+        }
+        ssize_t remain = n;
+        while(remain > 0){
+            ssize_t m = transport->splice(pipefd[0], to, remain);
+            if(m <= 0){
+                return -1;
+            }
+            remain -= m;
+        }
+        return n;
     }
 
     /**
@@ -262,36 +694,56 @@ public:
      * read reponse from server and send it to client
      * @param request request get from client
      * @param socket connection to client
-     * @param socket_server connection to server
+     * @param socket_server connection to server, connected here when the server is needed
+     * @param from_peer true if a peer proxy sent the request, it is then not asked of another peer
     */
-    void GET(http::request<http::dynamic_body> * request,int ID, tcp::socket * socket, tcp::socket * socket_server){
+    template<class Client>
+    void GET(arena_request * request,int ID, Client * socket, tcp::socket ** socket_server, bool from_peer){
         // POST(request, socket, socket_server);
         // boost::system::error_code ec;
 
-        std::string key;
-        key = std::string((*request)[http::field::host]) +": "+ std::string(request->target());
-        
-        if(cache.isInCache(key)){
-            //get response from cache
-            http::response<http::dynamic_body> * response = cache.get(key);
-            
+        //origin recently answered this GET with 5xx, do not ask again yet
+        if(serveNegative(request, ID, socket)){
+            return;
+        }
+
+        std::pmr::string key = cacheKey(request);
+        //get response from cache, the body may be shared with other keys
+        std::shared_ptr<const std::string> body;
+        std::shared_ptr<const http::response<http::empty_body> > cached = cache.get(key, &body);
+        const http::response<http::empty_body> * response = cached.get();
+
+        if(response != NULL){
             if(needValidationWhenAccess(response, ID)){
                 // pthread_mutex_lock(&lock);
                 // LogStream<<ID << ": in cache, requires validation"<<std::endl;
                 // pthread_mutex_unlock(&lock);
-                http::response<http::dynamic_body> vali_response = doValidation(socket_server,request, response, ID);
-                if(vali_response.result_int() ==200){
-                    cache.update(key, vali_response);
+                if(!openServer(request, ID, socket_server)){
+                    http::write(*socket, make502Response(request, ID));
+                    return;
+                }
+                http::response<http::dynamic_body> vali_response = doValidation(*socket_server,request, response, ID);
+                stampDate(&vali_response);
+                if(vali_response.result_int() != 304){
+                    if(cacheCanStore(request, &vali_response, ID)){
+                        cache.update(key, vali_response);
+                    }
                     http::write(*socket, vali_response);
                     pthread_mutex_lock(&lock);
                     LogStream<<ID<<": Responding \"" \
-                    << parseVersion(vali_response.version())<< " " << vali_response.result_int() << " "<<vali_response.reason()<<"\""<<std::endl;
+                    << clientVersion(vali_response.version())<< " " << vali_response.result_int() << " "<<vali_response.reason()<<"\""<<std::endl;
                     pthread_mutex_unlock(&lock);
                 }else{
-                    http::write(*socket, *response);
+                    //the 304 carries the new Date and freshness of the stored response
+                    std::shared_ptr<const http::response<http::empty_body> > refreshed = cache.refresh(key, vali_response);
+                    if(refreshed != NULL){
+                        cached = refreshed;
+                        response = cached.get();
+                    }
+                    writeCached(socket, response, *body);
                     pthread_mutex_lock(&lock);
                     LogStream<<ID<<": Responding \"" \
-                    << parseVersion(response->version())<< " " << response->result_int() << " "<<response->reason()<<"\""<<std::endl;
+                    << clientVersion(response->version())<< " " << response->result_int() << " "<<response->reason()<<"\""<<std::endl;
                     pthread_mutex_unlock(&lock);
 
                 }
@@ -300,30 +752,40 @@ public:
                 LogStream<<ID<< ": in cache, valid"<<std::endl;
                 // Send response to the client
                 LogStream<<ID<<": Responding \"" \
-                << parseVersion(response->version())<< " " << response->result_int() << " "<<response->reason()<<"\""<<std::endl;
+                << clientVersion(response->version())<< " " << response->result_int() << " "<<response->reason()<<"\""<<std::endl;
                 pthread_mutex_unlock(&lock);
-                http::write(*socket, *response);
+                writeCached(socket, response, *body);
             }
             // std::cout<<"Cached response is: "<<response->base()<<std::endl;
         }else{
             pthread_mutex_lock(&lock);
             LogStream<<ID<<": not in cache"<<std::endl;
+            pthread_mutex_unlock(&lock);
+            //in a cluster the peer owning the key fetches and caches it
+            if(!from_peer && askPeer(request, ID, socket, key)){
+                return;
+            }
+            pthread_mutex_lock(&lock);
             LogStream<<ID<<": Requesting \""<<request->method()<<" "<<request->target()\
             <<" "<<parseVersion(request->version())<<"\" from " << request->at("host")<<std::endl;
             pthread_mutex_unlock(&lock);
             //connect to server
-            http::write(*socket_server, *request);
+            if(!openServer(request, ID, socket_server)){
+                http::write(*socket, make502Response(request, ID));
+                return;
+            }
+            http::write(**socket_server, *request);
 
             //recieve the HTTP response from the server
-            boost::beast::flat_buffer buffer;
             http::response<http::dynamic_body> response;
-            boost::beast::http::read(*socket_server, buffer, response);
+            readResponse(*socket_server, &response);
             pthread_mutex_lock(&lock);
             LogStream<<ID<<": Received \"" \
             << parseVersion(response.version())<< " " << response.result_int() <<" "<< response.reason() \
             <<"\" from "<< request->at("host")<<std::endl;
             pthread_mutex_unlock(&lock);
             time_t expire;
+            stampDate(&response);
             //store in cache
             if(cacheCanStore(request, &response, ID)){
                 cache.put(key, response);
@@ -342,18 +804,36 @@ public:
                     LogStream<<ID<< ": cached, does not expire "<<std::endl;
                     pthread_mutex_unlock(&lock);
                 }
+            }else if(canCacheNegative(&response)){
+                cache.putNegative(key, response, gmtNow() + NEGATIVE_TTL);
+                pthread_mutex_lock(&lock);
+                LogStream<<ID<< ": NOTE server error remembered for "<<NEGATIVE_TTL<<" seconds"<<std::endl;
+                pthread_mutex_unlock(&lock);
             }
             // Send the response to the client
             http::write(*socket, response);
             pthread_mutex_lock(&lock);
             LogStream<<ID<<": Responding \"" \
-            << parseVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
+            << clientVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
             pthread_mutex_unlock(&lock);
             // std::cout<<"response is: "<<response.base()<<std::endl;
         }
         
     }
 
+    /**
+     * send a response from the cache: its header, then the body bytes as stored
+     * @param socket connection to client
+     * @param header header of the cached response, Content-Length matches the body
+     * @param body body of the cached response
+    */
+    template<class Client>
+    void writeCached(Client * socket, const http::response<http::empty_body> * header, const std::string & body){
+        http::response_serializer<http::empty_body> sr{*header};
+        http::write_header(*socket, sr);
+        net::write(*socket, net::buffer(body));
+    }
+
     /**
      * check if the response get from a cache need to be validate
      * yes: 1. the response has "no-cache", "must-revalidate" in cache-control
@@ -362,7 +842,7 @@ public:
      * @param response the response stored in cache
      * @return true is need validate; false if not
     */
-    bool needValidationWhenAccess(http::response<http::dynamic_body> * response, int ID){
+    bool needValidationWhenAccess(const http::response_header<> * response, int ID){
         if(hasValidation(response)){
             pthread_mutex_lock(&lock);
             LogStream<<ID << ": in cache, requires validation"<<std::endl;
@@ -387,62 +867,88 @@ public:
 
     /**
      * Get the exprire time of the response
+     * explicit freshness first (s-maxage, max-age, Expires), then heuristic
+     * freshness from Last-Modified; with neither the response is stale once received
      * @param response the reponse get from the server or from cache 
      * @param expire the placeholder for the expire time to return
      * @return 1 if expires at some time, 0 if not 
     */
-    int getExpireTime(http::response<http::dynamic_body> * response, time_t * expire){
-        //has cache control
+    int getExpireTime(const http::response_header<> * response, time_t * expire){
         try{
-            if(response->find(http::field::cache_control) != response->end()){
-                std::string str((*response)[http::field::cache_control]);
-                std::map<std::string, long> fields = parseFields(str);
-
-                std::string date_str((*response)[http::field::date]);
-                time_t date_value = parseDatetime(date_str);
-
-                if(fields.find("max-age") != fields.end()){
-                    *expire = date_value + fields["max-age"];
-                    return 1;
-                }else{
-                    //never expire
-                    expire = NULL;
-                    return 0;
-                }
-            }else{
-                if(response->find(http::field::expires)== response->end()){
-                    //never expire
-                    expire = NULL;
-                    return 0; 
-                }else{
-                    std::string expire_str((*response)[http::field::expires]);
-                    //what is the str is just 0 or -1;
-                    *expire = parseDatetime(expire_str);
-                    return 1;
+            field_map fields = parseFields((*response)[http::field::cache_control], arena());
+            //shared cache: s-maxage overrides max-age and Expires
+            if(fields.find("s-maxage") != fields.end()){
+                *expire = getDate(response) + fields["s-maxage"];
+                return 1;
+            }
+            if(fields.find("max-age") != fields.end()){
+                *expire = getDate(response) + fields["max-age"];
+                return 1;
+            }
+            if(response->find(http::field::expires) != response->end()){
+                //what is the str is just 0 or -1;
+                *expire = parseDatetime((*response)[http::field::expires]);
+                return 1;
+            }
+            time_t date_value = getDate(response);
+            if(response->find(http::field::last_modified) != response->end()){
+                time_t modified = parseDatetime((*response)[http::field::last_modified]);
+                long lifetime = 0;
+                if(date_value > modified){
+                    lifetime = std::min((long)(date_value - modified) / HEURISTIC_FRACTION, (long)HEURISTIC_MAX);
                 }
+                *expire = date_value + lifetime;
+                return 1;
             }
+            //no explicit or heuristic freshness
+            *expire = date_value;
+            return 1;
         }catch(std::invalid_argument & e){
+            //unparseable date, keep the old behaviour and never expire
             return 0;
-            expire = NULL;
         }
         return 0;
     }
 
-    bool hasValidation(http::response<http::dynamic_body> * response){
+    /**
+     * get the Date field of a response
+     * @param response the reponse get from the server or from cache
+     * @return parsed date, throws std::invalid_argument if missing or invalid
+    */
+    time_t getDate(const http::response_header<> * response){
+        return parseDatetime((*response)[http::field::date]);
+    }
+
+    /**
+     * add a Date field to a response from the server that has none,
+     * so its freshness can be computed later
+     * @param response the reponse get from the server
+    */
+    void stampDate(http::response<http::dynamic_body> * response){
+        if(response->find(http::field::date) == response->end()){
+            response->set(http::field::date, formatDatetime(gmtNow()));
+        }
+    }
+
+    bool hasValidation(const http::response_header<> * response){
         if(response->find(http::field::cache_control) != response->end()){
-            std::string str((*response)[http::field::cache_control]);
-            std::map<std::string, long> fields = parseFields(str);
+            field_map fields = parseFields((*response)[http::field::cache_control], arena());
             
             //if no-cache or must-revalidate, need validation
             if(fields.find("no-cache") != fields.end() || fields.find("must-revalidate") != fields.end()){
                 return true;
             }
-            //if max-age == 0
+            //if max-age == 0 or s-maxage == 0
             if(fields.find("max-age") != fields.end()){
                 if(fields["max-age"] == 0){
                     return true;
                 }
             }
+            if(fields.find("s-maxage") != fields.end()){
+                if(fields["s-maxage"] == 0){
+                    return true;
+                }
+            }
         }
         return false;
     }
@@ -454,8 +960,8 @@ public:
      * @param reponse old response saved in cache
      * @return conditonal request
     */
-    http::request<http::dynamic_body> makeConditionalRequest(http::request<http::dynamic_body> * request, http::response<http::dynamic_body> * response){
-        http::request<http::dynamic_body> new_request = *request;
+    arena_request makeConditionalRequest(arena_request * request, const http::response_header<> * response){
+        arena_request new_request = *request;
 
         if(response->find(http::field::etag)!=response->end()){
             new_request.set(http::field::if_none_match,(*response)[http::field::etag]);
@@ -474,18 +980,16 @@ public:
      * @param response response saved in cache
      * @return the response got from the server, 200 if updated, 304 if not
     */
-    http::response<http::dynamic_body> doValidation(tcp::socket * socket_server, http::request<http::dynamic_body> * request, http::response<http::dynamic_body> * response, int ID){
+    http::response<http::dynamic_body> doValidation(tcp::socket * socket_server, arena_request * request, const http::response_header<> * response, int ID){
         // boost::system::error_code ec;
-        http::request<http::dynamic_body> Crequest = makeConditionalRequest(request, response);
+        arena_request Crequest = makeConditionalRequest(request, response);
         http::write(*socket_server, Crequest);
         pthread_mutex_lock(&lock);
         LogStream<<ID<<": Validating \""<<Crequest.method()<<" "<<Crequest.target()\
         <<" "<<parseVersion(Crequest.version())<<"\" from "<<Crequest.at("host")<<std::endl;
         pthread_mutex_unlock(&lock);
-        boost::beast::flat_buffer buffer;
         http::response<http::dynamic_body> new_response;
-        
-        boost::beast::http::read(*socket_server, buffer, new_response);
+        readResponse(socket_server, &new_response);
         pthread_mutex_lock(&lock);
         LogStream<<ID<<": Recieve validation \""<< parseVersion(new_response.version())\
         << " " << new_response.result_int() <<" "<< new_response.reason() \
@@ -500,9 +1004,9 @@ public:
      * @param response
      * @return yes if can cache; no if not
     */
-    bool cacheCanStore(http::request<http::dynamic_body> * request, http::response<http::dynamic_body> * response, int ID){
-        //response is not cacheable 200 ok
-        if(response->result_int() != 200){
+    bool cacheCanStore(arena_request * request, const http::response_header<> * response, int ID){
+        //response code is not cacheable by default
+        if(!isCacheableStatus(response->result_int())){
             pthread_mutex_lock(&lock);
             LogStream<<ID <<": not cacheable because \"Response code is "<<response->result_int()<<"\""<<std::endl;
             pthread_mutex_unlock(&lock);
@@ -512,8 +1016,7 @@ public:
         if(response->find(http::field::cache_control) == response->end()){
             return true;
         }else{
-            std::string str((*response)[http::field::cache_control]);
-            std::map<std::string, long> fields = parseFields(str);
+            field_map fields = parseFields((*response)[http::field::cache_control], arena());
             //the "no-store" cache directive does not appear in request or response header fields
             if(fields.find("no-store") != fields.end()){
                 pthread_mutex_lock(&lock);
@@ -537,12 +1040,48 @@ public:
         return false;
     }
 
+    /**
+     * status codes that are cacheable by default (RFC 9110 section 15.1)
+     * @param status response code
+     * @return true if cacheable; false if not
+    */
+    bool isCacheableStatus(unsigned status){
+        switch(status){
+            case 200: case 203: case 204: case 206:
+            case 300: case 301: case 308:
+            case 404: case 405: case 410: case 414:
+            case 501:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * whether a response not stored in cache should be remembered for NEGATIVE_TTL
+     * to stop clients from hammering a failing server
+     * @param response the response get from the server
+     * @return true if it is a 5xx without "no-store"; false if not
+    */
+    bool canCacheNegative(const http::response_header<> * response){
+        if(response->result_int() < 500 || response->result_int() > 599){
+            return false;
+        }
+        if(response->find(http::field::cache_control) != response->end()){
+            beast::string_view str = (*response)[http::field::cache_control];
+            if(str.find("no-store") != beast::string_view::npos){
+                return false;
+            }
+        }
+        return true;
+    }
+
     /**
      * check whether the reponse in cache is still fresh
      * @param response the response stored in cache
      * @return true if still fresh; false if not
     */
-    bool isFresh(http::response<http::dynamic_body> * response){
+    bool isFresh(const http::response_header<> * response){
         time_t now;
         time(&now);
         time_t gmt_now = mktime(gmtime(&now));
@@ -561,39 +1100,65 @@ public:
     }
    
 
-    http::response<http::dynamic_body> make400Response(http::request<http::dynamic_body> * request, int ID ){
+    /**
+     * the version of a response as the client gets it, for the log
+     * a response to an HTTP/2 stream is built as HTTP/1.1 and sent in HTTP/2 frames
+    */
+    std::string clientVersion(unsigned version){
+        return serving_stream ? "HTTP/2" : parseVersion(version);
+    }
+
+    http::response<http::dynamic_body> make400Response(arena_request * request, int ID ){
         http::response<http::dynamic_body> response;
         response.result(boost::beast::http::status::bad_request);
         response.version(request->version());
         response.prepare_payload();
         pthread_mutex_lock(&lock);
         LogStream<<ID<<": Responding \"" \
-        << parseVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
+        << clientVersion(response.version())<< " " << response.result_int() << " "<<response.reason()<<"\""<<std::endl;
         pthread_mutex_unlock(&lock);
         return response;
     }
 
-    http::response<http::dynamic_body> make502Response(http::request<http::dynamic_body> * request, int ID ){
+    http::response<http::dynamic_body> make502Response(arena_request * request, int ID ){
         http::response<http::dynamic_body> response;
         response.result(http::status::bad_gateway);
         response.version(11);
         response.prepare_payload();
         pthread_mutex_lock(&lock);
         LogStream<<ID<<": Responding \"" \
-        << parseVersion(response.version())<< " " << response.result_int() << " "<< response.reason()<<"\""<<std::endl;
+        << clientVersion(response.version())<< " " << response.result_int() << " "<< response.reason()<<"\""<<std::endl;
         pthread_mutex_unlock(&lock);
         return response;
     }
 };
 
-int main(){
+/**
+ * usage: proxy [port [self peer...]]
+ * self and peers are the "host:port" names of the proxies of a cluster,
+ * every member must be started with the same set of names
+*/
+int main(int argc, char ** argv){
+    std::string host = "12345";
+    std::string self;
+    std::vector<std::string> peers;
+    if(argc > 1){
+        host = argv[1];
+    }
+    if(argc > 2){
+        self = argv[2];
+        for(int i = 3; i < argc; i++){
+            peers.push_back(argv[i]);
+        }
+    }
+    //a write to a closed connection fails with EPIPE instead of killing the proxy
+    signal(SIGPIPE, SIG_IGN);
     int status = daemon(1,1);
     if(status == -1){
         std::cerr<<"Daemon fail"<<std::endl;
         return EXIT_FAILURE;
     }
-    std::string host = "12345";
-    Proxy p(host, 1000);
+    Proxy p(host, 1000, self, peers);
     p.run();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,17 @@
+# start a cluster of three proxies on localhost, ports 12345-12347
+# every proxy logs to /var/log/erss/proxy-<port>.log
+make clean
+make 
+for port in 12345 12346 12347
+do
+    peers=""
+    for other in 12345 12346 12347
+    do
+        if [ $other != $port ]
+        then
+            peers="$peers 127.0.0.1:$other"
+        fi
+    done
+    PROXY_LOG=/var/log/erss/proxy-$port.log ./proxy $port 127.0.0.1:$port $peers
+done
+echo "start"